@@ -0,0 +1,215 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+extern int  anschroot_drop_caps(void);
+extern int  anschroot_session_get(const char* const id, const char* const key, char* const value, const size_t value_len);
+extern int  anschroot_session_live(const char* const id);
+
+/* Attaching to a running session.
+ *
+ * The session's first process (the child, PID 1 in its PID namespace) is looked up in the
+ * session registry and opened as a pidfd, which lets us enter all of its namespaces with a
+ * single setns(2) (on kernels older than 5.8, which can't do that, they are entered one by
+ * one through /proc instead). We then join its cgroup, chroot into its root, drop the same
+ * capabilities it did, and run the command. No mounting is involved at all.
+ */
+#define ATTACH_NAMESPACES       (CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWPID | CLONE_NEWNS)
+
+static const char* const attach_ns_files[] = { "ipc", "uts", "pid", "mnt" };
+
+static int attach_setns_proc(const pid_t pid)
+{
+	int fds[sizeof attach_ns_files / sizeof attach_ns_files[0]];
+	const size_t count = sizeof fds / sizeof fds[0];
+
+	// Open them all first; once we're in its mount namespace, /proc is a different one
+	for (size_t i = 0; i < count; i++)
+	{
+		char path[PATH_MAX];
+		(void) snprintf(path, sizeof path, "/proc/%ld/ns/%s", (long) pid, attach_ns_files[i]);
+
+		if ((fds[i] = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		{
+			while (i--)
+				(void) close(fds[i]);
+
+			return -1;
+		}
+	}
+
+	int ret = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (! ret && setns(fds[i], 0) != 0)
+			ret = -1;
+
+		(void) close(fds[i]);
+	}
+
+	return ret;
+}
+
+static int attach_cgroup(const char* const id)
+{
+	char path[PATH_MAX];
+	if (anschroot_session_get(id, "cgroup", path, sizeof path) != 0)
+		return 0;
+
+	(void) strncat(path, "/cgroup.procs", sizeof path - strlen(path) - 1);
+
+	int fd = -1;
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	const ssize_t ret = write(fd, "0", 1);
+	const int errsv = errno;
+	(void) close(fd);
+	errno = errsv;
+
+	return (ret == 1) ? 0 : -1;
+}
+
+/* Run exec_arg in the session id. Returns an exit status, like main(). */
+int anschroot_attach(const char* const id, char* const exec_arg)
+{
+	char value[32];
+	if (anschroot_session_get(id, "pid", value, sizeof value) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: session %s: %s\n", id, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	const pid_t pid = (pid_t) atol(value);
+
+	int pidfd = -1;
+	if ((pidfd = (int) syscall(SYS_pidfd_open, pid, 0)) == -1)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: pidfd_open(2): %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* The PID may have been reused since the registry was read, or the entry may be a stale one
+	 * (still naming the same PID) left by a session that was killed; now that we hold the
+	 * process, make sure the session is still running, and that it's still its child.
+	 */
+	if (! anschroot_session_live(id) || anschroot_session_get(id, "pid", value, sizeof value) != 0 ||
+	    (pid_t) atol(value) != pid)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: session %s: %s\n", id, strerror(ESRCH));
+		return EXIT_FAILURE;
+	}
+
+	char path[PATH_MAX];
+	(void) snprintf(path, sizeof path, "/proc/%ld/root", (long) pid);
+
+	int rootfd = -1;
+	if ((rootfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: open(2): %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// Until the session's child has chrooted, its root is still ours
+	struct stat root_st;
+	struct stat host_st;
+	if (fstat(rootfd, &root_st) != 0 || stat("/", &host_st) != 0 ||
+	    (root_st.st_dev == host_st.st_dev && root_st.st_ino == host_st.st_ino))
+	{
+		(void) fprintf(stderr, "nschroot[attach]: session %s is still starting\n", id);
+		return EXIT_FAILURE;
+	}
+
+	if (attach_cgroup(id) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: cgroup: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (setns(pidfd, ATTACH_NAMESPACES) != 0 && (errno != EINVAL || attach_setns_proc(pid) != 0))
+	{
+		(void) fprintf(stderr, "nschroot[attach]: setns(2): %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	(void) close(pidfd);
+
+	if (fchdir(rootfd) != 0 || chroot(".") != 0 || chdir("/") != 0)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: chroot(2): %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	(void) close(rootfd);
+
+	if (anschroot_drop_caps() != 0)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: capng_apply(3): %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// Entering a PID namespace only applies to children
+	pid_t child = fork();
+	if (child < 0)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: fork(2): %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (child == 0)
+	{
+		if (execv(exec_arg, (char* const []) { exec_arg, NULL }) != 0)
+			(void) fprintf(stderr, "nschroot[attach]: execv(3): %s\n", strerror(errno));
+
+		_exit(EXIT_FAILURE);
+	}
+
+	int status = 0;
+	if (waitpid(child, &status, 0) == -1)
+	{
+		(void) fprintf(stderr, "nschroot[attach]: waitpid(2): %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+
+	if (WIFSIGNALED(status))
+		(void) kill(getpid(), WTERMSIG(status));
+
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,384 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/magic.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+
+extern int          anschroot_session_get(const char* const id, const char* const key, char* const value, const size_t value_len);
+extern void         anschroot_session_foreach(void (*const fn)(const char* const id, void* const arg), void* const arg);
+extern const char*  anschroot_session_id(void);
+extern int          anschroot_session_set(const char* const key, const char* const value);
+
+/* Session cgroups, and preemption.
+ *
+ * Every session gets its own cgroup (v2) under CGROUP_BASE, named after its ID, which the
+ * child joins before setting itself up, so that everything running in the session is in it.
+ * A session can then be frozen (cgroup.freeze) and thawed again from outside, without
+ * losing any of its work; while it's frozen, its memory (including its tmpfs scratch space)
+ * can be pushed out to swap with memory.reclaim. That needs the memory controller, which is
+ * only enabled for the sessions if it is already delegated to CGROUP_BASE; the host's own
+ * cgroup configuration is never changed.
+ *
+ * Sessions also have a priority (default 0). When a session starts, every running session
+ * with a lower priority is frozen, and is listed under "preempted" in the new session's
+ * registry entry. When a session ends, the sessions it preempted are thawed, unless another
+ * running session has preempted them too. Sessions frozen by hand are left alone.
+ */
+#define CGROUP_BASE             "anschroot"
+#define CGROUP_RMDIR_TRIES      200
+#define CGROUP_RMDIR_WAIT       10000000L
+#define CGROUP_FREEZE_TIMEOUT   5000
+#define CGROUP_LIST_MAX         1024
+
+static char     cgroup_path[PATH_MAX];
+static char     cgroup_name[32];
+static int      cgroup_base_fd = -1;
+static int      cgroup_procs_fd = -1;
+
+static int cgroup_write(const int dirfd, const char* const file, const char* const value)
+{
+	int fd = -1;
+	if ((fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	const size_t len = strlen(value);
+	const ssize_t ret = write(fd, value, len);
+	const int errsv = errno;
+	(void) close(fd);
+	errno = errsv;
+
+	return (ret == (ssize_t) len) ? 0 : -1;
+}
+
+static int cgroup_read(const int dirfd, const char* const file, char* const buf, const size_t buf_len)
+{
+	int fd = -1;
+	if ((fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	const ssize_t len = read(fd, buf, buf_len - 1);
+	const int errsv = errno;
+	(void) close(fd);
+	errno = errsv;
+
+	if (len < 0)
+		return -1;
+
+	buf[len] = '\0';
+	return 0;
+}
+
+// The cgroup v2 hierarchy is at /sys/fs/cgroup, or at /sys/fs/cgroup/unified on hybrid hosts
+static const char* cgroup_mountpoint(void)
+{
+	static const char* const candidates[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+
+	for (size_t i = 0; i < sizeof candidates / sizeof candidates[0]; i++)
+	{
+		struct statfs sf;
+		if (statfs(candidates[i], &sf) == 0 && sf.f_type == CGROUP2_SUPER_MAGIC)
+			return candidates[i];
+	}
+
+	errno = ENOTSUP;
+	return NULL;
+}
+
+static int cgroup_wait_frozen(const int dirfd)
+{
+	int fd = -1;
+	if ((fd = openat(dirfd, "cgroup.events", O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	// cgroup.events signals a change with POLLPRI
+	struct pollfd pfd = { .fd = fd, .events = POLLPRI };
+	int frozen = 0;
+
+	for (int waited = 0; waited <= CGROUP_FREEZE_TIMEOUT; waited += 100)
+	{
+		char events[256];
+		const ssize_t len = pread(fd, events, sizeof events - 1, 0);
+		if (len < 0)
+			break;
+
+		events[len] = '\0';
+		if ((frozen = (strstr(events, "frozen 1") != NULL)))
+			break;
+
+		(void) poll(&pfd, 1, 100);
+	}
+	(void) close(fd);
+
+	if (! frozen)
+		errno = ETIMEDOUT;
+
+	return frozen ? 0 : -1;
+}
+
+/* Freeze (or thaw) the cgroup at path. Once it has frozen, optionally push as much of its
+ * memory as possible out to swap; that fails with ENOTSUP (the cgroup staying frozen) if the
+ * memory controller isn't enabled for it.
+ */
+int anschroot_cgroup_freeze(const char* const path, const int frozen, const int reclaim)
+{
+	int dirfd = -1;
+	if ((dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+
+	int ret = cgroup_write(dirfd, "cgroup.freeze", frozen ? "1" : "0");
+
+	if (! ret && frozen && reclaim)
+	{
+		char current[32];
+		if ((ret = cgroup_wait_frozen(dirfd)) == 0 && (ret = cgroup_read(dirfd, "memory.current", current, sizeof current)) != 0 &&
+		    errno == ENOENT)
+			errno = ENOTSUP;
+		else if (! ret)
+		{
+			current[strcspn(current, "\n")] = '\0';
+
+			// Short of everything is still progress, which is all that EAGAIN means here
+			if ((ret = cgroup_write(dirfd, "memory.reclaim", current)) != 0 && errno == EAGAIN)
+				ret = 0;
+		}
+	}
+
+	const int errsv = errno;
+	(void) close(dirfd);
+	errno = errsv;
+
+	return ret;
+}
+
+static int cgroup_frozen(const char* const path)
+{
+	int dirfd = -1;
+	if ((dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return 0;
+
+	char value[8] = { 0 };
+	(void) cgroup_read(dirfd, "cgroup.freeze", value, sizeof value);
+	(void) close(dirfd);
+
+	return value[0] == '1';
+}
+
+// Whether a comma-separated list of session IDs contains id
+static int cgroup_list_has(const char* const list, const char* const id)
+{
+	const size_t id_len = strlen(id);
+
+	for (const char* cur = list; *cur; )
+	{
+		const size_t len = strcspn(cur, ",");
+		if (len == id_len && ! memcmp(cur, id, len))
+			return 1;
+
+		cur += len;
+		if (*cur == ',')
+			cur++;
+	}
+
+	return 0;
+}
+
+struct cgroup_preempt
+{
+	int             priority;
+	char            list[CGROUP_LIST_MAX];
+};
+
+struct cgroup_claim
+{
+	const char*     id;
+	int             claimed;
+};
+
+static void cgroup_claimed_cb(const char* const id, void* const arg)
+{
+	struct cgroup_claim* const claim = arg;
+	char list[CGROUP_LIST_MAX];
+
+	if (anschroot_session_get(id, "preempted", list, sizeof list) == 0 && cgroup_list_has(list, claim->id))
+		claim->claimed = 1;
+}
+
+// Whether some other running session has preempted the session id
+static int cgroup_claimed(const char* const id)
+{
+	struct cgroup_claim claim = { .id = id, .claimed = 0 };
+	anschroot_session_foreach(cgroup_claimed_cb, &claim);
+
+	return claim.claimed;
+}
+
+static void cgroup_preempt_cb(const char* const id, void* const arg)
+{
+	struct cgroup_preempt* const preempt = arg;
+	char value[PATH_MAX];
+
+	if (anschroot_session_get(id, "priority", value, sizeof value) != 0 || atoi(value) >= preempt->priority)
+		return;
+
+	if (anschroot_session_get(id, "cgroup", value, sizeof value) != 0)
+		return;
+
+	// Somebody froze this one by hand; it's not ours to thaw later
+	if (cgroup_frozen(value) && ! cgroup_claimed(id))
+		return;
+
+	if (anschroot_cgroup_freeze(value, 1, 0) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: freeze: session %s: %s\n", id, strerror(errno));
+		return;
+	}
+
+	const size_t len = strlen(preempt->list);
+	(void) snprintf(preempt->list + len, sizeof preempt->list - len, "%s%s", len ? "," : "", id);
+}
+
+/* Freeze every running session with a lower priority than ours */
+int anschroot_cgroup_preempt(const int priority)
+{
+	struct cgroup_preempt preempt = { .priority = priority, .list = "" };
+	anschroot_session_foreach(cgroup_preempt_cb, &preempt);
+
+	if (! preempt.list[0])
+		return 0;
+
+	return anschroot_session_set("preempted", preempt.list);
+}
+
+/* Thaw the sessions we preempted, unless someone else has preempted them too */
+void anschroot_cgroup_resume(void)
+{
+	char list[CGROUP_LIST_MAX];
+	if (anschroot_session_get(anschroot_session_id(), "preempted", list, sizeof list) != 0)
+		return;
+
+	char* saveptr = NULL;
+	for (char* id = strtok_r(list, ",", &saveptr); id; id = strtok_r(NULL, ",", &saveptr))
+	{
+		char path[PATH_MAX];
+		if (cgroup_claimed(id) || anschroot_session_get(id, "cgroup", path, sizeof path) != 0)
+			continue;
+
+		if (anschroot_cgroup_freeze(path, 0, 0) != 0)
+			(void) fprintf(stderr, "nschroot[parent]: thaw: session %s: %s\n", id, strerror(errno));
+	}
+}
+
+/* Create the cgroup for session id. The handles to it are opened now, as the child is about
+ * to unmount /sys/fs/cgroup from the mount namespace that we share with it.
+ */
+int anschroot_cgroup_create(const char* const id)
+{
+	const char* const mountpoint = cgroup_mountpoint();
+	if (! mountpoint)
+		return -1;
+
+	char path[PATH_MAX];
+	(void) snprintf(path, sizeof path, "%s/%s", mountpoint, CGROUP_BASE);
+
+	if (mkdir(path, 0755) != 0 && errno != EEXIST)
+		return -1;
+
+	if ((cgroup_base_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+
+	// For memory.reclaim, if the memory controller is available to us at all
+	char controllers[256];
+	if (cgroup_read(cgroup_base_fd, "cgroup.controllers", controllers, sizeof controllers) == 0)
+	{
+		char* saveptr = NULL;
+		for (char* name = strtok_r(controllers, " \n", &saveptr); name; name = strtok_r(NULL, " \n", &saveptr))
+			if (! strcmp(name, "memory"))
+				(void) cgroup_write(cgroup_base_fd, "cgroup.subtree_control", "+memory");
+	}
+
+	(void) snprintf(cgroup_name, sizeof cgroup_name, "%s", id);
+	(void) snprintf(cgroup_path, sizeof cgroup_path, "%s/%s/%s", mountpoint, CGROUP_BASE, id);
+
+	if (mkdirat(cgroup_base_fd, cgroup_name, 0755) != 0 && errno != EEXIST)
+		return -1;
+
+	(void) snprintf(path, sizeof path, "%s/cgroup.procs", cgroup_name);
+	if ((cgroup_procs_fd = openat(cgroup_base_fd, path, O_WRONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	return 0;
+}
+
+const char* anschroot_cgroup_path(void)
+{
+	return cgroup_path;
+}
+
+/* Move the calling process (the child) into the session's cgroup */
+int anschroot_cgroup_join(void)
+{
+	if (cgroup_procs_fd == -1)
+		return 0;
+
+	const ssize_t ret = write(cgroup_procs_fd, "0", 1);
+	const int errsv = errno;
+	(void) close(cgroup_procs_fd);
+	cgroup_procs_fd = -1;
+	errno = errsv;
+
+	return (ret == 1) ? 0 : -1;
+}
+
+void anschroot_cgroup_release(void)
+{
+	if (cgroup_procs_fd != -1)
+		(void) close(cgroup_procs_fd);
+
+	cgroup_procs_fd = -1;
+
+	if (cgroup_base_fd == -1)
+		return;
+
+	// The rest of the session's processes are killed along with its PID namespace, but not instantly
+	const struct timespec wait = { .tv_sec = 0, .tv_nsec = CGROUP_RMDIR_WAIT };
+	for (int i = 0; i < CGROUP_RMDIR_TRIES; i++)
+	{
+		if (unlinkat(cgroup_base_fd, cgroup_name, AT_REMOVEDIR) == 0 || errno != EBUSY)
+			break;
+
+		(void) nanosleep(&wait, NULL);
+	}
+
+	(void) close(cgroup_base_fd);
+	cgroup_base_fd = -1;
+}
@@ -22,58 +22,808 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <poll.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-extern int  anschroot_drop_caps(void);
-extern int  anschroot_mount_paths_inroot(const char* const vm_root_path);
-extern void anschroot_umount_paths_outroot(const char* const vm_root_path);
+extern int         anschroot_admission_wait(const unsigned int timeout, char* const reason, const size_t reason_len);
+extern int         anschroot_attach(const char* const id, char* const exec_arg);
+extern int         anschroot_cgroup_create(const char* const id);
+extern int         anschroot_cgroup_freeze(const char* const path, const int frozen, const int reclaim);
+extern int         anschroot_cgroup_join(void);
+extern const char* anschroot_cgroup_path(void);
+extern int         anschroot_cgroup_preempt(const int priority);
+extern void        anschroot_cgroup_release(void);
+extern void        anschroot_cgroup_resume(void);
+extern int         anschroot_class_apply(void);
+extern const char* anschroot_class_name(void);
+extern int         anschroot_class_parse(const char* const name);
+extern int         anschroot_clone_create(const char* const src, char* const dst, const size_t dst_len);
+extern int         anschroot_clone_parse_mode(const char* const mode);
+extern void        anschroot_clone_remove_async(const char* const path, const int hostns_fd);
+extern int         anschroot_drop_caps(void);
+extern int         anschroot_image_mount(const char* const image_path, char* const vm_root_path, const size_t vm_root_path_len);
+extern int         anschroot_init_run(char* const exec_arg, const int statusfd);
+extern int         anschroot_init_wait(const int statusfd, int* const status, struct rusage* const ru);
+extern void        anschroot_metrics_failure(const char* const phase);
+extern uint64_t    anschroot_metrics_now(void);
+extern int         anschroot_journal_finish(const int dirfd, const char* const name);
+extern int         anschroot_journal_open(const char* const vm_root_path);
+extern int         anschroot_journal_start(void);
+extern int         anschroot_manifest_generate(const char* const root, const char* const path, const int incremental);
+extern int         anschroot_manifest_verify(const char* const root, const char* const path, const int incremental);
+extern int         anschroot_metrics_open(void);
+extern void        anschroot_metrics_phase(const char* const phase, const uint64_t start);
+extern void        anschroot_metrics_session_end(const int status, const struct rusage* const ru);
+extern void        anschroot_metrics_session_start(const char* const root, const char* const class);
+extern void        anschroot_metrics_setup_done(void);
+extern int         anschroot_metrics_write(const int dirfd);
+extern int         anschroot_mount_paths_inroot(const char* const vm_root_path);
+extern int         anschroot_perf_open(const pid_t pid);
+extern void        anschroot_perf_report(const int status);
+extern int         anschroot_profile_prewarm_load(const char* const profile_path);
+extern int         anschroot_profile_prewarm_start(const char* const vm_root_path);
+extern void        anschroot_profile_prewarm_finish(void);
+extern int         anschroot_profile_record_init(void);
+extern int         anschroot_profile_record_start(const char* const vm_root_path, const int setupfd, const int gofd);
+extern int         anschroot_profile_record_finish(const int profile_dirfd, const char* const profile_name);
+extern void        anschroot_scratch_release(void);
+extern int         anschroot_scratch_monitor_start(void);
+extern void        anschroot_scratch_monitor_stop(void);
+extern int         anschroot_scratch_setup(const char* const vm_root_path, const unsigned long long hint, const char* const scratch_dir);
+extern int         anschroot_session_get(const char* const id, const char* const key, char* const value, const size_t value_len);
+extern const char* anschroot_session_id(void);
+extern int         anschroot_session_register(const char* const root);
+extern int         anschroot_session_set(const char* const key, const char* const value);
+extern void        anschroot_session_unregister(void);
+extern void        anschroot_umount_paths_outroot(const char* const vm_root_path);
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+#define ADMISSION_TIMEOUT_DEFAULT 300
+#define SCRATCH_DIR_DEFAULT "/var/tmp/anschroot"
+
+static const struct option anschroot_options[] = {
+	{ "admission",            optional_argument,  NULL,   'a' },
+	{ "async-teardown",       no_argument,        NULL,   'x' },
+	{ "attach",               required_argument,  NULL,   'A' },
+	{ "class",                required_argument,  NULL,   'C' },
+	{ "clone",                optional_argument,  NULL,   'c' },
+	{ "prewarm",              no_argument,        NULL,   'p' },
+	{ "priority",             required_argument,  NULL,   'N' },
+	{ "reclaim",              no_argument,        NULL,   'R' },
+	{ "perf",                 no_argument,        NULL,   'e' },
+	{ "freeze",               required_argument,  NULL,   'F' },
+	{ "generate-manifest",    no_argument,        NULL,   'g' },
+	{ "incremental",          no_argument,        NULL,   'I' },
+	{ "journal",              required_argument,  NULL,   'j' },
+	{ "manifest",             required_argument,  NULL,   'M' },
+	{ "metrics-dir",          required_argument,  NULL,   'm' },
+	{ "propagation",          required_argument,  NULL,   'P' },
+	{ "record-profile",       no_argument,        NULL,   'r' },
+	{ "scratch-dir",          required_argument,  NULL,   'd' },
+	{ "scratch-size",         required_argument,  NULL,   's' },
+	{ "thaw",                 required_argument,  NULL,   'T' },
+	{ NULL,                   0,                  NULL,   0   },
+};
+
+static void anschroot_usage(const char* const progname)
+{
+	(void) fprintf(stderr, "Usage: %s [options] <directory|image> <executable>\n", progname);
+	(void) fprintf(stderr, "       %s --attach=ID <executable>\n", progname);
+	(void) fprintf(stderr, "       %s --freeze=ID [--reclaim] | --thaw=ID\n", progname);
+	(void) fprintf(stderr, "       %s --manifest=FILE --generate-manifest [--incremental] <directory|image>\n", progname);
+	(void) fprintf(stderr, "\n");
+	(void) fprintf(stderr, "  -a, --admission[=SECS]  Wait (for up to SECS, default %d) for CPU, memory and IO\n", ADMISSION_TIMEOUT_DEFAULT);
+	(void) fprintf(stderr, "                          pressure to clear before starting; fail if it doesn't\n");
+	(void) fprintf(stderr, "  -x, --async-teardown    Exit as soon as the executable does, leaving the rest of\n");
+	(void) fprintf(stderr, "                          the session to be torn down in the background\n");
+	(void) fprintf(stderr, "  -A, --attach=ID         Run the executable in the running session ID\n");
+	(void) fprintf(stderr, "  -C, --class=CLASS       Scheduling class of the session: interactive (default),\n");
+	(void) fprintf(stderr, "                          batch or idle\n");
+	(void) fprintf(stderr, "  -c, --clone[=MODE]      Run in a disposable copy of the directory, removed afterwards;\n");
+	(void) fprintf(stderr, "                          MODE is reflink (default), copy or hardlink\n");
+	(void) fprintf(stderr, "  -e, --perf              Count CPU cycles, instructions, cache and branch misses,\n");
+	(void) fprintf(stderr, "                          page faults, context switches and CPU migrations for the\n");
+	(void) fprintf(stderr, "                          session, and print a summary when it ends\n");
+	(void) fprintf(stderr, "  -F, --freeze=ID         Freeze the running session ID (see /run/anschroot/sessions)\n");
+	(void) fprintf(stderr, "  -R, --reclaim           With --freeze, push the session's memory out to swap\n");
+	(void) fprintf(stderr, "  -T, --thaw=ID           Thaw the frozen session ID\n");
+	(void) fprintf(stderr, "  -M, --manifest=FILE     Verify the root against the manifest FILE before entering it\n");
+	(void) fprintf(stderr, "  -g, --generate-manifest Write a manifest of the root to FILE instead\n");
+	(void) fprintf(stderr, "  -I, --incremental       With --manifest, only hash files whose size, inode or times\n");
+	(void) fprintf(stderr, "                          have changed since FILE was written (directories only)\n");
+	(void) fprintf(stderr, "  -j, --journal=FILE      Write the paths created, modified or deleted in the root\n");
+	(void) fprintf(stderr, "                          during the session to FILE\n");
+	(void) fprintf(stderr, "  -m, --metrics-dir=DIR   Write metrics to DIR/anschroot.prom (for a textfile collector)\n");
+	(void) fprintf(stderr, "  -P, --propagation=TYPE  Mount propagation of the new mount namespace: private\n");
+	(void) fprintf(stderr, "                          (default), slave, or unchanged (shared with the host)\n");
+	(void) fprintf(stderr, "  -p, --prewarm           Read ahead the files listed in the root's access profile\n");
+	(void) fprintf(stderr, "  -N, --priority=N        Session priority (default 0); starting a session freezes all\n");
+	(void) fprintf(stderr, "                          running sessions of lower priority until it ends\n");
+	(void) fprintf(stderr, "  -r, --record-profile    Record the files opened by the session into the root's\n");
+	(void) fprintf(stderr, "                          access profile (<directory|image>.prewarm)\n");
+	(void) fprintf(stderr, "  -d, --scratch-dir=DIR   Where to put disk-backed build directories (default: %s)\n", SCRATCH_DIR_DEFAULT);
+	(void) fprintf(stderr, "  -s, --scratch-size=SIZE Expected build directory usage (e.g. 512M, 8G)\n");
+}
+
+// Parse a size with an optional K/M/G/T suffix
+static int anschroot_parse_size(const char* const str, unsigned long long* const size)
+{
+	char* end = NULL;
+	errno = 0;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end)
+	{
+		case 'T': case 't':
+			value <<= 10;
+			/* FALLTHROUGH */
+		case 'G': case 'g':
+			value <<= 10;
+			/* FALLTHROUGH */
+		case 'M': case 'm':
+			value <<= 10;
+			/* FALLTHROUGH */
+		case 'K': case 'k':
+			value <<= 10;
+			end++;
+			break;
+	}
+
+	if (*end)
+		return -1;
+
+	*size = value;
+	return 0;
+}
+
+/* Open the directory that path is in (and point name at the last component of path), for
+ * writing a file there with openat(2) at the end of the session.
+ */
+static int anschroot_open_parent(const char* const path, const char** const name)
+{
+	char dir[PATH_MAX];
+	(void) snprintf(dir, sizeof dir, "%s", path);
+
+	char* const slash = strrchr(dir, '/');
+	*name = path;
+	if (slash)
+	{
+		*name = path + (slash - dir) + 1;
+		slash[(slash == dir) ? 1 : 0] = '\0';
+	}
+
+	return open(slash ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* Signals that would otherwise kill us before we've torn the session down are passed on to
+ * the child instead. As PID 1 of its namespace, the child only gets them if it handles them,
+ * so a second one kills it outright.
+ */
+static volatile sig_atomic_t anschroot_child = 0;
+static volatile sig_atomic_t anschroot_signalled = 0;
+
+static void anschroot_forward_signal(const int sig)
+{
+	const int errsv = errno;
+
+	if (anschroot_child > 0)
+		(void) kill((pid_t) anschroot_child, anschroot_signalled++ ? SIGKILL : sig);
+
+	errno = errsv;
+}
+
+// Release everything the session holds, once the child is gone (or was never started)
+static void anschroot_teardown(const char* const vm_root_path, const int hostns_fd)
+{
+	anschroot_scratch_release();
+	anschroot_cgroup_resume();
+	anschroot_cgroup_release();
+	anschroot_session_unregister();
+
+	if (hostns_fd != -1)
+		anschroot_clone_remove_async(vm_root_path, hostns_fd);
+}
+
+/* Hand the teardown over to a detached process, so that we can exit straight away.
+ *
+ * It kills off whatever is left of the session (the init, which takes everything else in the
+ * PID namespace with it), waits for the kernel to finish tearing the namespace down, and only
+ * then releases the rest. Its standard streams are pointed at nullfd; holding on to ours
+ * would keep e.g. a pipeline we're part of from finishing until it did.
+ */
+static void anschroot_teardown_async(const pid_t pid, const char* const vm_root_path, const int hostns_fd, const int nullfd)
+{
+	// Threads don't survive fork(2)
+	anschroot_scratch_monitor_stop();
+
+	const int pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+
+	pid_t reaper = fork();
+	if (reaper < 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: fork(2): %s\n", strerror(errno));
+		anschroot_teardown(vm_root_path, hostns_fd);
+		return;
+	}
+
+	if (reaper > 0)
+	{
+		(void) waitpid(reaper, NULL, 0);
+
+		if (pidfd != -1)
+			(void) close(pidfd);
+
+		return;
+	}
+
+	(void) setsid();
+	if (fork() > 0)
+		_exit(EXIT_SUCCESS);
+
+	(void) dup2(nullfd, STDIN_FILENO);
+	(void) dup2(nullfd, STDOUT_FILENO);
+	(void) dup2(nullfd, STDERR_FILENO);
+
+	if (pidfd != -1)
+	{
+		struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+
+		(void) syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0);
+
+		while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+			continue;
+	}
+
+	anschroot_teardown(vm_root_path, hostns_fd);
+	_exit(EXIT_SUCCESS);
+}
 
 int main(int argc, char* argv[])
 {
 	char vm_root_path[PATH_MAX];
 	memset(vm_root_path, 0x00, PATH_MAX);
 
+	int opt_admission = 0;
+	unsigned int opt_admission_timeout = ADMISSION_TIMEOUT_DEFAULT;
+	const char* opt_attach_id = NULL;
+	int opt_async_teardown = 0;
+	const char* opt_manifest = NULL;
+	int opt_generate_manifest = 0;
+	int opt_incremental = 0;
+	int opt_clone = 0;
+	int opt_perf = 0;
+	int opt_prewarm = 0;
+	int opt_priority = 0;
+	int opt_reclaim = 0;
+	int opt_frozen = 0;
+	const char* opt_control_id = NULL;
+	int opt_record = 0;
+	unsigned long opt_propagation = MS_PRIVATE;
+	unsigned long long opt_scratch_size = 0;
+	const char* opt_scratch_dir = SCRATCH_DIR_DEFAULT;
+	const char* opt_metrics_dir = NULL;
+	const char* opt_journal = NULL;
+
+	int opt = 0;
+	while ((opt = getopt_long(argc, argv, "+a::A:C:c::eF:gIj:M:m:P:pN:Rrd:s:T:x", anschroot_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'a':
+				opt_admission = 1;
+				if (optarg)
+					opt_admission_timeout = (unsigned int) strtoul(optarg, NULL, 10);
+				break;
+			case 'C':
+				if (anschroot_class_parse(optarg) != 0)
+				{
+					(void) fprintf(stderr, "%s: invalid class '%s'\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'c':
+				if (anschroot_clone_parse_mode(optarg) != 0)
+				{
+					(void) fprintf(stderr, "%s: invalid clone mode '%s'\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				opt_clone = 1;
+				break;
+			case 'e':
+				opt_perf = 1;
+				break;
+			case 'x':
+				opt_async_teardown = 1;
+				break;
+			case 'M':
+				opt_manifest = optarg;
+				break;
+			case 'g':
+				opt_generate_manifest = 1;
+				break;
+			case 'I':
+				opt_incremental = 1;
+				break;
+			case 'A':
+			case 'F':
+			case 'T':
+				if (! *optarg || strspn(optarg, "0123456789") != strlen(optarg))
+				{
+					(void) fprintf(stderr, "%s: invalid session ID '%s'\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				if (opt == 'A')
+					opt_attach_id = optarg;
+				else
+					opt_control_id = optarg;
+				opt_frozen = (opt == 'F');
+				break;
+			case 'j':
+				opt_journal = optarg;
+				break;
+			case 'm':
+				opt_metrics_dir = optarg;
+				break;
+			case 'P':
+				if (! strcmp(optarg, "private"))
+					opt_propagation = MS_PRIVATE;
+				else if (! strcmp(optarg, "slave"))
+					opt_propagation = MS_SLAVE;
+				else if (! strcmp(optarg, "unchanged"))
+					opt_propagation = 0;
+				else
+				{
+					(void) fprintf(stderr, "%s: invalid propagation type '%s'\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'p':
+				opt_prewarm = 1;
+				break;
+			case 'N':
+				opt_priority = atoi(optarg);
+				break;
+			case 'R':
+				opt_reclaim = 1;
+				break;
+			case 'r':
+				opt_record = 1;
+				break;
+			case 'd':
+				opt_scratch_dir = optarg;
+				break;
+			case 's':
+				if (anschroot_parse_size(optarg, &opt_scratch_size) != 0)
+				{
+					(void) fprintf(stderr, "%s: invalid size '%s'\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			default:
+				anschroot_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	// Freeze or thaw another session, rather than starting one
+	if (opt_control_id)
+	{
+		char cgroup[PATH_MAX];
+		if (anschroot_session_get(opt_control_id, "cgroup", cgroup, sizeof cgroup) != 0)
+		{
+			(void) fprintf(stderr, "%s: session %s has no cgroup: %s\n", argv[0], opt_control_id, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (anschroot_cgroup_freeze(cgroup, opt_frozen, opt_reclaim) != 0)
+		{
+			if (opt_reclaim && errno == ENOTSUP)
+				(void) fprintf(stderr, "%s: --reclaim is unavailable: the memory controller is not enabled for %s "
+				               "(session %s was frozen)\n", argv[0], cgroup, opt_control_id);
+			else
+				(void) fprintf(stderr, "%s: %s: %s\n", argv[0], cgroup, strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	// Write a manifest of a root, rather than entering it
+	if (opt_generate_manifest)
+	{
+		if (! opt_manifest || argc - optind != 1)
+		{
+			anschroot_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		const char* manifest_root = argv[optind];
+		struct stat manifest_root_st;
+		if (stat(manifest_root, &manifest_root_st) != 0)
+		{
+			(void) fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (! S_ISDIR(manifest_root_st.st_mode) && ! S_ISREG(manifest_root_st.st_mode))
+		{
+			(void) fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(ENOTDIR));
+			return EXIT_FAILURE;
+		}
+
+		/* Describe an image as a session sees it (and so verifies it), mounted, in a mount
+		 * namespace of our own.
+		 */
+		char image_root[PATH_MAX];
+		if (S_ISREG(manifest_root_st.st_mode))
+		{
+			if (opt_incremental)
+			{
+				(void) fprintf(stderr, "%s: --incremental can't be used with an image (its files can "
+				               "change without their inodes or times changing)\n", argv[0]);
+				return EXIT_FAILURE;
+			}
+			if (unshare(CLONE_NEWNS) != 0 || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0 ||
+			    anschroot_image_mount(argv[optind], image_root, sizeof image_root) != 0)
+			{
+				(void) fprintf(stderr, "%s: image: %s: %s\n", argv[0], argv[optind], strerror(errno));
+				return EXIT_FAILURE;
+			}
+			manifest_root = image_root;
+		}
+
+		if (anschroot_manifest_generate(manifest_root, opt_manifest, opt_incremental) != 0)
+		{
+			(void) fprintf(stderr, "%s: manifest: %s of %s: %s\n", argv[0], opt_manifest, argv[optind], strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	// Run a command in another session, rather than starting one
+	if (opt_attach_id)
+	{
+		if (argc - optind < 1)
+		{
+			anschroot_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		return anschroot_attach(opt_attach_id, argv[optind]);
+	}
+
 	// Check arguments were given
-	if (argc < 3)
+	if (argc - optind < 2)
+	{
+		anschroot_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	char* const root_arg = argv[optind];
+	char* const exec_arg = argv[optind + 1];
+
+	/* Work with the canonical (absolute, without symlinks or trailing slashes) path of the
+	 * directory argument. It's compared against paths the kernel gives back to us (for the
+	 * journal and access profiles), and the clone is removed from the host's mount namespace,
+	 * where our working directory doesn't apply.
+	 */
+	if (! realpath(root_arg, vm_root_path))
+	{
+		(void) fprintf(stderr, "nschroot[parent]: realpath(3): %s: %s\n", root_arg, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// A regular file instead of a directory is an EROFS or squashfs image of the root
+	struct stat root_st;
+	if (stat(vm_root_path, &root_st) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: stat(2): %s: %s\n", vm_root_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	const int vm_root_is_image = S_ISREG(root_st.st_mode);
+
+	if (opt_clone && vm_root_is_image)
+	{
+		(void) fprintf(stderr, "%s: --clone needs a directory (image roots are already copy-on-write)\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (opt_manifest && opt_incremental && vm_root_is_image)
+	{
+		(void) fprintf(stderr, "%s: --incremental can't be used with an image (its files can change without "
+		               "their inodes or times changing)\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// Every image session stages its mounts under the same path, so they mustn't reach the host
+	if (vm_root_is_image && ! opt_propagation)
+	{
+		(void) fprintf(stderr, "%s: image roots need private or slave propagation\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// Metrics are always collected (cheaply), but only written out on request
+	if (anschroot_metrics_open() != 0)
+		(void) fprintf(stderr, "nschroot[parent]: metrics: %s\n", strerror(errno));
+
+	// Hold the launch back while the host is already overcommitted
+	if (opt_admission)
 	{
-		(void) fprintf(stderr, "Usage: %s <directory> <executable>\n", argv[0]);
+		char reason[128];
+		const uint64_t admission_start = anschroot_metrics_now();
+		if (anschroot_admission_wait(opt_admission_timeout, reason, sizeof reason) != 0)
+		{
+			(void) fprintf(stderr, "nschroot[parent]: admission: refused: %s\n", reason);
+			anschroot_metrics_failure("admission");
+			return EXIT_FAILURE;
+		}
+		anschroot_metrics_phase("admission", admission_start);
+	}
+
+	int metrics_dirfd = -1;
+	if (opt_metrics_dir && (metrics_dirfd = open(opt_metrics_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: open(2): %s: %s\n", opt_metrics_dir, strerror(errno));
 		return EXIT_FAILURE;
 	}
 
-	/* Copy the directory argument so we can modify it without making e.g. `ps` output
-	 * look 'weird'.
+	/* The access profile lives next to the root (e.g. /path.prewarm for /path).
 	 *
-	 * E.g.: anschroot /path/ /foo/bar     becomes     anschroot /path  /foo/bar
+	 * Load it, and open the directory it's written to, now; the child is about to unmount
+	 * every filesystem that isn't under the root, and that may include this one.
 	 */
-	(void) snprintf(vm_root_path, PATH_MAX, "%s", argv[1]);
+	char profile_path[PATH_MAX];
+	if (snprintf(profile_path, sizeof profile_path, "%s.prewarm", vm_root_path) >= (int) sizeof profile_path &&
+	    (opt_prewarm || opt_record))
+	{
+		(void) fprintf(stderr, "nschroot[parent]: %s.prewarm: %s\n", vm_root_path, strerror(ENAMETOOLONG));
+		return EXIT_FAILURE;
+	}
 
-	// Remove trailing forward slashes from the directory argument (if present)
-	size_t rootpath_len = strlen(vm_root_path);
-	while (rootpath_len > 1 && vm_root_path[--rootpath_len] == '/')
-		vm_root_path[rootpath_len] = '\0';
+	if (opt_prewarm && anschroot_profile_prewarm_load(profile_path) != 0)
+		(void) fprintf(stderr, "nschroot[parent]: %s: %s\n", profile_path, strerror(errno));
 
+	int profile_dirfd = -1;
+	const char* profile_name = profile_path;
+	int setupfds[2] = { -1, -1 };
+	if (opt_record)
+	{
+		if ((profile_dirfd = anschroot_open_parent(profile_path, &profile_name)) == -1)
+		{
+			(void) fprintf(stderr, "nschroot[parent]: open(2): %s: %s\n", profile_path, strerror(errno));
+			return EXIT_FAILURE;
+		}
 
+		if (anschroot_profile_record_init() != 0)
+		{
+			(void) fprintf(stderr, "nschroot[parent]: open(2): /proc/self: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
 
-	/* Put the process into a new set of all namespaces (except user & net)
+		// Lets us know when the child has finished setting up
+		if (pipe2(setupfds, O_CLOEXEC) != 0)
+		{
+			(void) fprintf(stderr, "nschroot[parent]: pipe2(2): %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Likewise for the journal
+	int journal_dirfd = -1;
+	const char* journal_name = NULL;
+	if (opt_journal && (journal_dirfd = anschroot_open_parent(opt_journal, &journal_name)) == -1)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: open(2): %s: %s\n", opt_journal, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// For the detached teardown (the child may unmount /dev from under us)
+	int nullfd = -1;
+	if (opt_async_teardown && (nullfd = open("/dev/null", O_RDWR | O_CLOEXEC)) == -1)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: open(2): /dev/null: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// Keep a handle on our own PID namespace (see below)
+	int pidns_fd = -1;
+	if ((pidns_fd = open("/proc/self/ns/pid", O_RDONLY | O_CLOEXEC)) == -1)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: open(2): /proc/self/ns/pid: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// ... and on the host's mount namespace, which the clone is removed from in the end
+	int hostns_fd = -1;
+	if (opt_clone && (hostns_fd = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC)) == -1)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: open(2): /proc/self/ns/mnt: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Put the process into a new set of all namespaces (except user, net & PID; the
+	 * latter is done just before forking the child, as the setup below may need to run
+	 * helper programs, and the first of those would otherwise become the new PID 1).
+	 */
+	uint64_t phase_start = anschroot_metrics_now();
+	if (unshare(CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWNS) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: unshare(2): %s\n", strerror(errno));
+		anschroot_metrics_failure("unshare");
+		return EXIT_FAILURE;
+	}
+
+	/* The new mount namespace is a copy of the host's, including its shared peer groups, so
+	 * every mount and umount made in it (there are a lot of them; see the child below) would
+	 * otherwise propagate to the host and to every other session, all under the kernel's
+	 * global mount lock. Cut it off from them, once, recursively.
 	 *
-	 * Note that CLONE_NEWPID does not put the calling process (this) into a new PID
+	 * A slave still receives mounts made on the host (e.g. removable media), without sending
+	 * any back.
+	 */
+	if (opt_propagation && mount(NULL, "/", NULL, MS_REC | opt_propagation, NULL) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: mount(2): %s\n", strerror(errno));
+		anschroot_metrics_failure("unshare");
+		return EXIT_FAILURE;
+	}
+	anschroot_metrics_phase("unshare", phase_start);
+
+	// Mount the image (if any) before forking, so that the parent can see the root too
+	if (vm_root_is_image)
+	{
+		phase_start = anschroot_metrics_now();
+		if (anschroot_image_mount(root_arg, vm_root_path, PATH_MAX) != 0)
+		{
+			(void) fprintf(stderr, "nschroot[parent]: image: %s: %s\n", root_arg, strerror(errno));
+			anschroot_metrics_failure("image");
+			return EXIT_FAILURE;
+		}
+		anschroot_metrics_phase("image", phase_start);
+	}
+
+	// Make sure the root is what it should be, before running anything in it
+	if (opt_manifest)
+	{
+		phase_start = anschroot_metrics_now();
+		if (anschroot_manifest_verify(vm_root_path, opt_manifest, opt_incremental) != 0)
+		{
+			if (errno == EBADMSG)
+				(void) fprintf(stderr, "nschroot[parent]: manifest: %s doesn't match %s\n", root_arg, opt_manifest);
+			else
+				(void) fprintf(stderr, "nschroot[parent]: manifest: %s: %s\n", opt_manifest, strerror(errno));
+			anschroot_metrics_failure("manifest");
+			return EXIT_FAILURE;
+		}
+		anschroot_metrics_phase("manifest", phase_start);
+	}
+
+	/* From here on, the session holds things that only we can release (a clone, its cgroup and
+	 * any sessions it has frozen, a zram device); hold back signals that would kill us until
+	 * there's a child to pass them on to.
+	 */
+	sigset_t forward_sigmask;
+	sigset_t saved_sigmask;
+	(void) sigemptyset(&forward_sigmask);
+	(void) sigaddset(&forward_sigmask, SIGHUP);
+	(void) sigaddset(&forward_sigmask, SIGINT);
+	(void) sigaddset(&forward_sigmask, SIGTERM);
+	(void) sigprocmask(SIG_BLOCK, &forward_sigmask, &saved_sigmask);
+
+	// Make a disposable copy of the root to run in instead
+	if (opt_clone)
+	{
+		char clone_src[PATH_MAX];
+		(void) snprintf(clone_src, sizeof clone_src, "%s", vm_root_path);
+
+		phase_start = anschroot_metrics_now();
+		if (anschroot_clone_create(clone_src, vm_root_path, PATH_MAX) != 0)
+		{
+			(void) fprintf(stderr, "nschroot[parent]: clone: %s: %s\n", vm_root_path, strerror(errno));
+			anschroot_metrics_failure("clone");
+			return EXIT_FAILURE;
+		}
+		anschroot_metrics_phase("clone", phase_start);
+	}
+
+	// Register the session (this is also how concurrent sessions are counted)
+	if (anschroot_session_register(root_arg) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: session: %s\n", strerror(errno));
+		if (opt_clone)
+			anschroot_clone_remove_async(vm_root_path, hostns_fd);
+		return EXIT_FAILURE;
+	}
+	if (opt_clone)
+		(void) anschroot_session_set("clone", vm_root_path);
+
+	// Put the session in a cgroup of its own, and make way for it if it's more important
+	char priority[16];
+	(void) snprintf(priority, sizeof priority, "%d", opt_priority);
+	(void) anschroot_session_set("priority", priority);
+	(void) anschroot_session_set("class", anschroot_class_name());
+
+	if (anschroot_cgroup_create(anschroot_session_id()) == 0)
+		(void) anschroot_session_set("cgroup", anschroot_cgroup_path());
+	else
+		(void) fprintf(stderr, "nschroot[parent]: cgroup: %s\n", strerror(errno));
+
+	if (anschroot_cgroup_preempt(opt_priority) != 0)
+		(void) fprintf(stderr, "nschroot[parent]: preempt: %s\n", strerror(errno));
+
+	// Set up the Portage build directory, on whichever backend suits the host right now
+	phase_start = anschroot_metrics_now();
+	if (anschroot_scratch_setup(vm_root_path, opt_scratch_size, opt_scratch_dir) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: scratch: %s\n", strerror(errno));
+		anschroot_metrics_failure("scratch");
+		anschroot_teardown(vm_root_path, hostns_fd);
+		return EXIT_FAILURE;
+	}
+	anschroot_metrics_phase("scratch", phase_start);
+
+	// Start the journal before the child exists, so that nothing it does is missed
+	if (opt_journal && anschroot_journal_open(vm_root_path) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: journal: %s\n", strerror(errno));
+		anschroot_teardown(vm_root_path, hostns_fd);
+		return EXIT_FAILURE;
+	}
+
+	// Carries the executable's exit status from the init, with --async-teardown
+	int statusfds[2] = { -1, -1 };
+	if (opt_async_teardown && pipe2(statusfds, O_CLOEXEC) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: pipe2(2): %s\n", strerror(errno));
+		anschroot_teardown(vm_root_path, hostns_fd);
+		return EXIT_FAILURE;
+	}
+
+	/* Holds the child back, before it executes anything, until its counters are open and the
+	 * files it opens are being recorded
+	 */
+	int gofds[2] = { -1, -1 };
+	if ((opt_perf || opt_record) && pipe2(gofds, O_CLOEXEC) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: pipe2(2): %s\n", strerror(errno));
+		anschroot_teardown(vm_root_path, hostns_fd);
+		return EXIT_FAILURE;
+	}
+
+	/* Note that CLONE_NEWPID does not put the calling process (this) into a new PID
 	 * namespace, as that would break a lot of libraries and programs that expect
 	 * getpid(2) to always return the same value over the lifetime of their execution,
 	 * but it does mean the next child we create (fork(2)) will be PID 1 in the new
 	 * PID namespace, acting as its init. For more information see pid_namespaces(7).
 	 */
-	if (unshare(CLONE_NEWIPC | CLONE_NEWPID | CLONE_NEWUTS | CLONE_NEWNS) != 0)
+	phase_start = anschroot_metrics_now();
+	if (unshare(CLONE_NEWPID) != 0)
 	{
 		(void) fprintf(stderr, "nschroot[parent]: unshare(2): %s\n", strerror(errno));
+		anschroot_metrics_failure("unshare");
+		anschroot_teardown(vm_root_path, hostns_fd);
 		return EXIT_FAILURE;
 	}
 
@@ -82,27 +832,136 @@ int main(int argc, char* argv[])
 	if (pid < 0)
 	{
 		(void) fprintf(stderr, "nschroot[parent]: fork(2): %s\n", strerror(errno));
+		anschroot_metrics_failure("fork");
+		anschroot_teardown(vm_root_path, hostns_fd);
 		return EXIT_FAILURE;
 	}
 
 	// Parent
 	if (pid > 0)
 	{
-		// Wait for child to terminate
+		const struct sigaction forward = { .sa_handler = anschroot_forward_signal, .sa_flags = SA_RESTART };
+
+		anschroot_child = (sig_atomic_t) pid;
+		(void) sigaction(SIGHUP, &forward, NULL);
+		(void) sigaction(SIGINT, &forward, NULL);
+		(void) sigaction(SIGTERM, &forward, NULL);
+		(void) sigprocmask(SIG_SETMASK, &saved_sigmask, NULL);
+
+		if (opt_async_teardown)
+			(void) close(statusfds[1]);
+
+		if (opt_perf && ! anschroot_perf_open(pid))
+		{
+			(void) fprintf(stderr, "nschroot[parent]: perf_event_open(2): %s\n", strerror(errno));
+			opt_perf = 0;
+		}
+
+		// With --record-profile, it's up to the recorder (below) to let the child go
+		if (gofds[0] != -1)
+		{
+			(void) close(gofds[0]);
+
+			if (! opt_record)
+			{
+				if (write(gofds[1], "", 1) != 1)
+					(void) fprintf(stderr, "nschroot[parent]: write(2): %s\n", strerror(errno));
+
+				(void) close(gofds[1]);
+			}
+		}
+
+		anschroot_metrics_phase("fork", phase_start);
+		anschroot_metrics_session_start(root_arg, anschroot_class_name());
+
+		// For --attach
+		char child_pid[32];
+		(void) snprintf(child_pid, sizeof child_pid, "%ld", (long) pid);
+		(void) anschroot_session_set("pid", child_pid);
+
+		if (metrics_dirfd != -1 && anschroot_metrics_write(metrics_dirfd) != 0)
+			(void) fprintf(stderr, "nschroot[parent]: metrics: %s\n", strerror(errno));
+
+		/* The kernel refuses to create threads while the PID namespace for our children
+		 * differs from our own, so now that the child exists, switch back to our own.
+		 */
+		if (setns(pidns_fd, CLONE_NEWPID) != 0)
+			(void) fprintf(stderr, "nschroot[parent]: setns(2): %s\n", strerror(errno));
+
+		(void) close(pidns_fd);
+
+		if (anschroot_scratch_monitor_start() != 0)
+			(void) fprintf(stderr, "nschroot[parent]: scratch: %s\n", strerror(errno));
+
+		// Overlap reading the profiled files in with the child's setup
+		if (opt_prewarm && anschroot_profile_prewarm_start(vm_root_path) != 0)
+			(void) fprintf(stderr, "nschroot[parent]: prewarm: %s\n", strerror(errno));
+
+		if (opt_journal && anschroot_journal_start() != 0)
+			(void) fprintf(stderr, "nschroot[parent]: journal: %s\n", strerror(errno));
+
+		if (opt_record)
+		{
+			(void) close(setupfds[1]);
+
+			if (anschroot_profile_record_start(vm_root_path, setupfds[0], gofds[1]) != 0)
+			{
+				(void) fprintf(stderr, "nschroot[parent]: record: %s\n", strerror(errno));
+
+				if (write(gofds[1], "", 1) != 1)
+					(void) fprintf(stderr, "nschroot[parent]: write(2): %s\n", strerror(errno));
+
+				(void) close(gofds[1]);
+			}
+		}
+
+		/* Wait for child to terminate (or, with --async-teardown, for the init to tell us
+		 * that the executable has; if it doesn't, wait for the init itself instead)
+		 */
 		int status = 0;
-		if (waitpid(pid, &status, 0) == -1)
+		struct rusage ru;
+		if (! opt_async_teardown || anschroot_init_wait(statusfds[0], &status, &ru) != 0)
 		{
-			(void) fprintf(stderr, "nschroot[parent]: waitpid(3): %s\n", strerror(errno));
-			return EXIT_FAILURE;
+			if (wait4(pid, &status, 0, &ru) == -1)
+			{
+				(void) fprintf(stderr, "nschroot[parent]: wait4(2): %s\n", strerror(errno));
+				return EXIT_FAILURE;
+			}
 		}
 
+		anschroot_metrics_session_end(status, &ru);
+
+		if (opt_perf)
+			anschroot_perf_report(status);
+
+		// Before the teardown; removing a clone is not a change anyone wants journalled
+		if (opt_journal && anschroot_journal_finish(journal_dirfd, journal_name) != 0)
+			(void) fprintf(stderr, "nschroot[parent]: %s: %s\n", opt_journal, strerror(errno));
+
+		if (metrics_dirfd != -1 && anschroot_metrics_write(metrics_dirfd) != 0)
+			(void) fprintf(stderr, "nschroot[parent]: metrics: %s\n", strerror(errno));
+
+		if (opt_prewarm)
+			anschroot_profile_prewarm_finish();
+
+		if (opt_record && anschroot_profile_record_finish(profile_dirfd, profile_name) != 0)
+			(void) fprintf(stderr, "nschroot[parent]: %s: %s\n", profile_path, strerror(errno));
+
+		if (opt_async_teardown)
+			anschroot_teardown_async(pid, vm_root_path, hostns_fd, nullfd);
+		else
+			anschroot_teardown(vm_root_path, hostns_fd);
+
 		// If the child exited normally, exit with the same return code
 		if (WIFEXITED(status))
 			return WEXITSTATUS(status);
 
 		// If the child died due to a signal, kill ourselves with the same signal
 		if (WIFSIGNALED(status))
+		{
+			(void) signal(WTERMSIG(status), SIG_DFL);
 			(void) kill(getpid(), WTERMSIG(status));
+		}
 
 		return EXIT_FAILURE;
 	}
@@ -111,38 +970,120 @@ int main(int argc, char* argv[])
 	/* Child continues execution here */
 	/**********************************/
 
+	// Before anything else, so that everything the session does is accounted to it
+	if (anschroot_cgroup_join() != 0)
+	{
+		(void) fprintf(stderr, "nschroot[child]: cgroup: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// While the host's /proc is still there
+	if (anschroot_class_apply() != 0)
+	{
+		(void) fprintf(stderr, "nschroot[child]: class %s: %s\n", anschroot_class_name(), strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	(void) close(pidns_fd);
+
+	if (opt_clone)
+		(void) close(hostns_fd);
+
+	if (opt_record)
+		(void) close(setupfds[0]);
+
+	if (metrics_dirfd != -1)
+		(void) close(metrics_dirfd);
+
+	if (gofds[1] != -1)
+		(void) close(gofds[1]);
+
+	if (opt_journal)
+		(void) close(journal_dirfd);
+
+	if (opt_async_teardown)
+	{
+		(void) close(statusfds[0]);
+		(void) close(nullfd);
+	}
+
 	// Unmount as many unnecessary filesystems as we can (avoid polluting /proc/mounts in the child)
+	phase_start = anschroot_metrics_now();
 	(void) anschroot_umount_paths_outroot(vm_root_path);
+	anschroot_metrics_phase("umount", phase_start);
 
 	// Mount filesystems that the child will need
+	phase_start = anschroot_metrics_now();
 	if (anschroot_mount_paths_inroot(vm_root_path) != 0)
 	{
 		(void) fprintf(stderr, "nschroot[child]: mount(2): %s\n", strerror(errno));
+		anschroot_metrics_failure("mount");
 		return EXIT_FAILURE;
 	}
+	anschroot_metrics_phase("mount", phase_start);
 
 	// Change root filesystem
+	phase_start = anschroot_metrics_now();
 	if (chroot(vm_root_path) != 0)
 	{
 		(void) fprintf(stderr, "nschroot[child]: chroot(2): %s\n", strerror(errno));
+		anschroot_metrics_failure("chroot");
 		return EXIT_FAILURE;
 	}
 	if (chdir("/") != 0)
 	{
 		(void) fprintf(stderr, "nschroot[child]: chdir(2): %s\n", strerror(errno));
+		anschroot_metrics_failure("chroot");
 		return EXIT_FAILURE;
 	}
+	anschroot_metrics_phase("chroot", phase_start);
 
 	// Drop privilege
+	phase_start = anschroot_metrics_now();
 	if (anschroot_drop_caps() != 0)
 	{
 		(void) fprintf(stderr, "nschroot[child]: capng_apply(3): %s\n", strerror(errno));
+		anschroot_metrics_failure("caps");
 		return EXIT_FAILURE;
 	}
+	anschroot_metrics_phase("caps", phase_start);
+
+	// Tell the recorder we're ready to go
+	if (opt_record)
+	{
+		if (write(setupfds[1], "", 1) != 1)
+		{
+			(void) fprintf(stderr, "nschroot[child]: write(2): %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		(void) close(setupfds[1]);
+	}
+
+	// Wait for the go-ahead (EOF means the parent has gone away)
+	if (gofds[0] != -1)
+	{
+		char go = 0;
+		const ssize_t ret = read(gofds[0], &go, 1);
+		if (ret != 1)
+		{
+			(void) fprintf(stderr, "nschroot[child]: read(2): %s\n", strerror(ret ? errno : EPIPE));
+			return EXIT_FAILURE;
+		}
+		(void) close(gofds[0]);
+	}
+
+	anschroot_metrics_setup_done();
+
+	// Stay on as init, and run the executable under us
+	if (opt_async_teardown)
+		return anschroot_init_run(exec_arg, statusfds[1]);
+
+	(void) sigprocmask(SIG_SETMASK, &saved_sigmask, NULL);
 
 	// Execute a shell
-	if (execv(argv[2], (char* const []) { argv[2], NULL }) != 0)
+	if (execv(exec_arg, (char* const []) { exec_arg, NULL }) != 0)
 		(void) fprintf(stderr, "nschroot[child]: execv(3): %s\n", strerror(errno));
 
+	anschroot_metrics_failure("exec");
 	return EXIT_FAILURE;
 }
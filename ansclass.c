@@ -0,0 +1,153 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef SCHED_BATCH
+#define SCHED_BATCH 3
+#endif
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+
+#define IOPRIO_CLASS_NONE       0
+#define IOPRIO_CLASS_BE         2
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_WHO_PROCESS      1
+#define IOPRIO_PRIO_VALUE(c, d) (((c) << 13) | (d))
+
+/* Session classes.
+ *
+ * A class says how a session's work should be treated by the scheduler relative to everything
+ * else on the host. "interactive" leaves the caller's settings alone. "batch" is for builds
+ * and other throughput work: SCHED_BATCH (no wakeup preemption, longer timeslices), the
+ * lowest best-effort IO priority, and a large timer slack so that its timers can be coalesced.
+ * "idle" only gets the CPU and disk when nothing else wants them.
+ *
+ * The non-interactive classes also get a session (and so, an autogroup) of their own, with a
+ * lowered autogroup nice level; otherwise, under the autogroup scheduler, all of the sessions
+ * started from one terminal would share (and compete within) that terminal's autogroup. That
+ * is only done when there is no controlling terminal, though (e.g. under a build scheduler):
+ * a new session would lose it, and with it job control, /dev/tty and the terminal's signals.
+ */
+#define CLASSES_COUNT           (sizeof classes / sizeof classes[0])
+
+static const struct class {
+	const char*     name;
+	int             policy;         // -1 to leave alone
+	int             ioprio;         // IOPRIO_CLASS_NONE to leave alone
+	unsigned long   timerslack;     // Nanoseconds; 0 to leave alone
+	int             autogroup_nice; // Or 0, to stay in the caller's autogroup
+} classes[] = {
+	{ "interactive",        -1,             IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0),        0,              0  },
+	{ "batch",              SCHED_BATCH,    IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7),          50000000UL,     10 },
+	{ "idle",               SCHED_IDLE,     IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0),        100000000UL,    19 },
+};
+
+static size_t class_index = 0;
+
+int anschroot_class_parse(const char* const name)
+{
+	for (size_t i = 0; i < CLASSES_COUNT; i++)
+	{
+		if (! strcmp(classes[i].name, name))
+		{
+			class_index = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char* anschroot_class_name(void)
+{
+	return classes[class_index].name;
+}
+
+static int class_autogroup(const int nice)
+{
+	// Keep the controlling terminal, if there is one (see above)
+	int ttyfd = -1;
+	if ((ttyfd = open("/dev/tty", O_RDONLY | O_NOCTTY | O_CLOEXEC)) != -1)
+	{
+		(void) close(ttyfd);
+		return 0;
+	}
+
+	if (setsid() == -1)
+		return -1;
+
+	// Signals sent to the caller's process group now only reach the parent; go when it does
+	if (prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0) != 0)
+		return -1;
+
+	int fd = -1;
+	if ((fd = open("/proc/self/autogroup", O_WRONLY | O_CLOEXEC)) == -1)
+		return (errno == ENOENT) ? 0 : -1;
+
+	char value[16];
+	(void) snprintf(value, sizeof value, "%d", nice);
+
+	const ssize_t ret = write(fd, value, strlen(value));
+	const int errsv = errno;
+	(void) close(fd);
+	errno = errsv;
+
+	return (ret == (ssize_t) strlen(value)) ? 0 : -1;
+}
+
+/* Apply the class to the calling process (and so, everything it goes on to run). Needs the
+ * host's /proc, for the autogroup.
+ */
+int anschroot_class_apply(void)
+{
+	const struct class* const class = &classes[class_index];
+
+	if (class->policy != -1)
+	{
+		const struct sched_param param = { .sched_priority = 0 };
+
+		if (sched_setscheduler(0, class->policy, &param) != 0)
+			return -1;
+	}
+
+	if ((class->ioprio >> 13) != IOPRIO_CLASS_NONE)
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, class->ioprio) != 0)
+			return -1;
+
+	if (class->timerslack && prctl(PR_SET_TIMERSLACK, class->timerslack, 0, 0, 0) != 0)
+		return -1;
+
+	if (class->autogroup_nice && class_autogroup(class->autogroup_nice) != 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,751 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+/* Disposable writable copies of a root.
+ *
+ * The tree is walked by a pool of threads, each with its own queue of directories still to
+ * be copied; a thread that runs out of work steals the oldest (and so probably largest)
+ * directory from another thread's queue. Regular files are cloned with FICLONE where the
+ * filesystem supports reflinks (btrfs, XFS), which shares their data extents instead of
+ * copying them, falling back to copy_file_range(2) and then to a plain copy. Alternatively,
+ * a hardlink farm can be made instead, which is faster still, but only safe for tools that
+ * replace files rather than modifying them in place.
+ *
+ * Ownership, permissions, extended attributes (notably file capabilities), timestamps and
+ * hardlinks within the tree are preserved.
+ */
+#define CLONE_THREADS_MAX       16
+#define CLONE_LINKS_SIZE        4096
+#define CLONE_COPY_BUFSZ        (1024 * 1024)
+
+enum clone_mode
+{
+	CLONE_REFLINK,
+	CLONE_COPY,
+	CLONE_HARDLINK,
+};
+
+struct clone_job
+{
+	char*                   src;
+	char*                   dst;
+};
+
+struct clone_worker
+{
+	pthread_mutex_t         lock;
+	struct clone_job*       jobs;
+	size_t                  head;
+	size_t                  tail;
+	size_t                  alloc;
+	pthread_t               thread;
+};
+
+struct clone_dir
+{
+	struct clone_dir*       next;
+	struct timespec         times[2];
+	char                    path[];
+};
+
+struct clone_link
+{
+	struct clone_link*      next;
+	dev_t                   dev;
+	ino_t                   ino;
+	int                     state;          // 0 while the first copy is being made, then 1 (or -1 if it failed)
+	char                    path[];
+};
+
+static enum clone_mode          clone_mode = CLONE_REFLINK;
+static struct clone_worker      clone_workers[CLONE_THREADS_MAX];
+static unsigned int             clone_workers_count = 0;
+static size_t                   clone_pending = 0;
+static int                      clone_error = 0;
+
+static pthread_mutex_t          clone_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           clone_idle_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long            clone_pushed = 0;
+
+static pthread_mutex_t          clone_dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct clone_dir*        clone_dirs = NULL;
+
+static pthread_mutex_t          clone_links_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           clone_links_cond = PTHREAD_COND_INITIALIZER;
+static struct clone_link*       clone_links[CLONE_LINKS_SIZE];
+
+static void clone_fail(const int err)
+{
+	int expected = 0;
+	(void) __atomic_compare_exchange_n(&clone_error, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static int clone_push(struct clone_worker* const worker, char* const src, char* const dst)
+{
+	(void) pthread_mutex_lock(&worker->lock);
+
+	if (worker->tail == worker->alloc)
+	{
+		// Compact the queue (stolen jobs leave a gap at the head) before growing it
+		if (worker->head)
+		{
+			(void) memmove(worker->jobs, worker->jobs + worker->head, (worker->tail - worker->head) * sizeof(*worker->jobs));
+			worker->tail -= worker->head;
+			worker->head = 0;
+		}
+
+		if (worker->tail == worker->alloc)
+		{
+			const size_t alloc_new = worker->alloc ? (worker->alloc * 2) : 64;
+			struct clone_job* jobs_new = realloc(worker->jobs, alloc_new * sizeof(*jobs_new));
+			if (! jobs_new)
+			{
+				(void) pthread_mutex_unlock(&worker->lock);
+				return -1;
+			}
+
+			worker->jobs = jobs_new;
+			worker->alloc = alloc_new;
+		}
+	}
+
+	worker->jobs[worker->tail].src = src;
+	worker->jobs[worker->tail].dst = dst;
+	worker->tail++;
+	(void) __atomic_add_fetch(&clone_pending, 1, __ATOMIC_RELAXED);
+
+	(void) pthread_mutex_unlock(&worker->lock);
+
+	// Wake somebody idle to steal it
+	(void) pthread_mutex_lock(&clone_idle_lock);
+	clone_pushed++;
+	(void) pthread_cond_signal(&clone_idle_cond);
+	(void) pthread_mutex_unlock(&clone_idle_lock);
+
+	return 0;
+}
+
+// Take the newest job from our own queue (depth-first, for locality)
+static int clone_pop(struct clone_worker* const worker, struct clone_job* const job)
+{
+	int found = 0;
+	(void) pthread_mutex_lock(&worker->lock);
+
+	if (worker->tail > worker->head)
+	{
+		*job = worker->jobs[--worker->tail];
+		found = 1;
+	}
+	if (worker->tail == worker->head)
+		worker->head = worker->tail = 0;
+
+	(void) pthread_mutex_unlock(&worker->lock);
+	return found;
+}
+
+// Take the oldest job from somebody else's queue
+static int clone_steal(const unsigned int self, struct clone_job* const job)
+{
+	for (unsigned int i = 1; i < clone_workers_count; i++)
+	{
+		struct clone_worker* const victim = &clone_workers[(self + i) % clone_workers_count];
+		int found = 0;
+
+		if (pthread_mutex_trylock(&victim->lock) != 0)
+			continue;
+
+		if (victim->tail > victim->head)
+		{
+			*job = victim->jobs[victim->head++];
+			found = 1;
+		}
+		if (victim->tail == victim->head)
+			victim->head = victim->tail = 0;
+
+		(void) pthread_mutex_unlock(&victim->lock);
+
+		if (found)
+			return 1;
+	}
+
+	return 0;
+}
+
+static char* clone_path(const char* const dir, const char* const name)
+{
+	char* path = NULL;
+	if (asprintf(&path, "%s/%s", dir, name) == -1)
+		return NULL;
+
+	return path;
+}
+
+// Read the list of names (name is NULL) or a value into a new buffer; the size can change under us
+static ssize_t clone_xattr_get(const char* const path, const char* const name, char** const buf)
+{
+	for (;;)
+	{
+		const ssize_t size = name ? lgetxattr(path, name, NULL, 0) : llistxattr(path, NULL, 0);
+		if (size < 0)
+			return -1;
+
+		if (! (*buf = malloc((size_t) size + 1)))
+			return -1;
+
+		const ssize_t len = name ? lgetxattr(path, name, *buf, (size_t) size) : llistxattr(path, *buf, (size_t) size);
+		if (len >= 0 || errno != ERANGE)
+			return len;
+
+		free(*buf);
+		*buf = NULL;
+	}
+}
+
+static int clone_xattrs(const char* const src, const char* const dst)
+{
+	char* names = NULL;
+	const ssize_t names_len = clone_xattr_get(src, NULL, &names);
+	if (names_len < 0)
+	{
+		free(names);
+		return (errno == ENOTSUP) ? 0 : -1;
+	}
+
+	int ret = 0;
+	for (const char* name = names; ! ret && name < names + names_len; name += strlen(name) + 1)
+	{
+		// Gone since we listed it, or not one we can read at all, is as good as not there
+		char* value = NULL;
+		const ssize_t value_len = clone_xattr_get(src, name, &value);
+		if (value_len < 0)
+			ret = (errno == ENODATA || errno == ENOTSUP) ? 0 : -1;
+		else if (lsetxattr(dst, name, value, (size_t) value_len, 0) != 0 && errno != ENOTSUP)
+			ret = -1;
+
+		const int errsv = errno;
+		free(value);
+		errno = errsv;
+	}
+
+	const int errsv = errno;
+	free(names);
+	errno = errsv;
+
+	return ret;
+}
+
+// Copy ownership, permissions and extended attributes (in that order; chown(2) clears capabilities)
+static int clone_metadata(const char* const src, const char* const dst, const struct stat* const st)
+{
+	if (lchown(dst, st->st_uid, st->st_gid) != 0)
+		return -1;
+
+	if (! S_ISLNK(st->st_mode) && chmod(dst, st->st_mode & 07777) != 0)
+		return -1;
+
+	return clone_xattrs(src, dst);
+}
+
+static int clone_times(const char* const dst, const struct stat* const st)
+{
+	const struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	return utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static int clone_data(const int srcfd, const int dstfd, const off_t size)
+{
+	if (clone_mode == CLONE_REFLINK && ioctl(dstfd, FICLONE, srcfd) == 0)
+		return 0;
+
+	off_t done = 0;
+	while (done < size)
+	{
+		const ssize_t ret = copy_file_range(srcfd, NULL, dstfd, NULL, (size_t) (size - done), 0);
+		if (ret <= 0)
+			break;
+
+		done += ret;
+	}
+	if (done >= size)
+		return 0;
+
+	// Neither works (e.g. across filesystems on old kernels); do it the hard way
+	char* buf = NULL;
+	if (! (buf = malloc(CLONE_COPY_BUFSZ)))
+		return -1;
+
+	ssize_t ret = 0;
+	while ((ret = pread(srcfd, buf, CLONE_COPY_BUFSZ, done)) > 0)
+	{
+		if (pwrite(dstfd, buf, (size_t) ret, done) != ret)
+		{
+			ret = -1;
+			break;
+		}
+
+		done += ret;
+	}
+	free(buf);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+static int clone_file(const char* const src, const char* const dst, const struct stat* const st)
+{
+	if (clone_mode == CLONE_HARDLINK)
+		return link(src, dst);
+
+	int srcfd = -1;
+	if ((srcfd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+		return -1;
+
+	int dstfd = -1;
+	if ((dstfd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) == -1)
+	{
+		(void) close(srcfd);
+		return -1;
+	}
+
+	int ret = clone_data(srcfd, dstfd, st->st_size);
+	const int errsv = errno;
+
+	(void) close(srcfd);
+	if (close(dstfd) != 0 && ! ret)
+		return -1;
+
+	errno = errsv;
+	return ret;
+}
+
+/* Files with more than one link are linked to the first copy made of them, so that hardlinks
+ * within the tree stay hardlinks. Returns 1 if dst was linked to an existing copy. Otherwise,
+ * dst is to be that first copy; *first is then set, and clone_hardlink_done() must be called
+ * with it once the copy has been made (anybody else meeting the same file waits until then).
+ */
+static int clone_hardlink(const char* const dst, const struct stat* const st, struct clone_link** const first)
+{
+	const size_t bucket = ((size_t) st->st_ino ^ (size_t) st->st_dev) % CLONE_LINKS_SIZE;
+	int ret = 0;
+
+	(void) pthread_mutex_lock(&clone_links_lock);
+
+	struct clone_link* cur = clone_links[bucket];
+	for (; cur; cur = cur->next)
+		if (cur->dev == st->st_dev && cur->ino == st->st_ino)
+			break;
+
+	if (cur)
+	{
+		while (! cur->state)
+			(void) pthread_cond_wait(&clone_links_cond, &clone_links_lock);
+
+		if (cur->state < 0)
+		{
+			// The clone as a whole has failed already
+			errno = ECANCELED;
+			ret = -1;
+		}
+		else
+		{
+			ret = (link(cur->path, dst) == 0) ? 1 : -1;
+		}
+	}
+	else
+	{
+		struct clone_link* const entry = malloc(sizeof(*entry) + strlen(dst) + 1);
+		if (entry)
+		{
+			entry->dev = st->st_dev;
+			entry->ino = st->st_ino;
+			entry->state = 0;
+			(void) strcpy(entry->path, dst);
+			entry->next = clone_links[bucket];
+			clone_links[bucket] = entry;
+		}
+
+		*first = entry;
+	}
+
+	(void) pthread_mutex_unlock(&clone_links_lock);
+	return ret;
+}
+
+static void clone_hardlink_done(struct clone_link* const first, const int ok)
+{
+	(void) pthread_mutex_lock(&clone_links_lock);
+	first->state = ok ? 1 : -1;
+	(void) pthread_cond_broadcast(&clone_links_cond);
+	(void) pthread_mutex_unlock(&clone_links_lock);
+}
+
+// Directory timestamps can only be set once everything in them has been created
+static void clone_dir_later(const char* const dst, const struct stat* const st)
+{
+	struct clone_dir* const entry = malloc(sizeof(*entry) + strlen(dst) + 1);
+	if (! entry)
+		return;
+
+	entry->times[0] = st->st_atim;
+	entry->times[1] = st->st_mtim;
+	(void) strcpy(entry->path, dst);
+
+	(void) pthread_mutex_lock(&clone_dirs_lock);
+	entry->next = clone_dirs;
+	clone_dirs = entry;
+	(void) pthread_mutex_unlock(&clone_dirs_lock);
+}
+
+// Takes ownership of src and dst, and reports its own errors
+static int clone_entry(struct clone_worker* const worker, char* const src, char* const dst)
+{
+	int ret = 0;
+
+	struct stat st;
+	if ((ret = lstat(src, &st)) != 0)
+		goto out;
+
+	if (S_ISDIR(st.st_mode))
+	{
+		if ((ret = mkdir(dst, 0700)) != 0 || (ret = clone_metadata(src, dst, &st)) != 0)
+			goto out;
+
+		clone_dir_later(dst, &st);
+
+		// Ownership of src and dst passes to the queue
+		if ((ret = clone_push(worker, src, dst)) == 0)
+			return 0;
+
+		errno = ENOMEM;
+		goto out;
+	}
+
+	struct clone_link* first = NULL;
+	if (S_ISREG(st.st_mode) && st.st_nlink > 1 && clone_mode != CLONE_HARDLINK)
+		if ((ret = clone_hardlink(dst, &st, &first)) != 0)
+			goto out;
+
+	if (S_ISREG(st.st_mode))
+	{
+		ret = clone_file(src, dst, &st);
+
+		if (first)
+			clone_hardlink_done(first, ! ret);
+
+		if (ret != 0 || clone_mode == CLONE_HARDLINK)
+			goto out;
+	}
+	else if (S_ISLNK(st.st_mode))
+	{
+		char target[PATH_MAX];
+		const ssize_t len = readlink(src, target, sizeof target - 1);
+		if (len < 0)
+		{
+			ret = -1;
+			goto out;
+		}
+
+		target[len] = '\0';
+		if ((ret = symlink(target, dst)) != 0)
+			goto out;
+	}
+	else
+	{
+		// Device nodes, FIFOs and sockets
+		if ((ret = mknod(dst, st.st_mode, st.st_rdev)) != 0)
+			goto out;
+	}
+
+	if ((ret = clone_metadata(src, dst, &st)) == 0)
+		ret = clone_times(dst, &st);
+
+out:
+	if (ret < 0)
+		(void) fprintf(stderr, "nschroot[parent]: clone: %s: %s\n", src, strerror(errno));
+
+	const int errsv = errno;
+	free(src);
+	free(dst);
+	errno = errsv;
+
+	return (ret < 0) ? -1 : 0;
+}
+
+static void clone_dir(struct clone_worker* const worker, const struct clone_job* const job)
+{
+	DIR* dh = NULL;
+	if (! (dh = opendir(job->src)))
+	{
+		clone_fail(errno);
+		return;
+	}
+
+	struct dirent* de = NULL;
+	while ((de = readdir(dh)) && ! __atomic_load_n(&clone_error, __ATOMIC_RELAXED))
+	{
+		if (! strcmp(de->d_name, ".") || ! strcmp(de->d_name, ".."))
+			continue;
+
+		char* const src = clone_path(job->src, de->d_name);
+		char* const dst = clone_path(job->dst, de->d_name);
+		if (! src || ! dst)
+		{
+			free(src);
+			free(dst);
+			clone_fail(ENOMEM);
+			break;
+		}
+
+		if (clone_entry(worker, src, dst) != 0)
+			clone_fail(errno);
+	}
+	(void) closedir(dh);
+}
+
+static void* clone_worker(void* const arg)
+{
+	const unsigned int self = (unsigned int) (uintptr_t) arg;
+	struct clone_worker* const worker = &clone_workers[self];
+
+	for (;;)
+	{
+		struct clone_job job;
+
+		(void) pthread_mutex_lock(&clone_idle_lock);
+		const unsigned long pushed = clone_pushed;
+		(void) pthread_mutex_unlock(&clone_idle_lock);
+
+		if (clone_pop(worker, &job) || clone_steal(self, &job))
+		{
+			if (! __atomic_load_n(&clone_error, __ATOMIC_RELAXED))
+				clone_dir(worker, &job);
+
+			free(job.src);
+			free(job.dst);
+
+			// That was the last of it; let everybody waiting for more work go
+			if (! __atomic_sub_fetch(&clone_pending, 1, __ATOMIC_RELAXED))
+			{
+				(void) pthread_mutex_lock(&clone_idle_lock);
+				(void) pthread_cond_broadcast(&clone_idle_cond);
+				(void) pthread_mutex_unlock(&clone_idle_lock);
+			}
+
+			continue;
+		}
+
+		/* Nothing to do; wait until somebody else finds more (anything pushed since we last
+		 * looked), or we're finished because nobody else is still working either.
+		 */
+		(void) pthread_mutex_lock(&clone_idle_lock);
+		while (clone_pushed == pushed && __atomic_load_n(&clone_pending, __ATOMIC_RELAXED))
+			(void) pthread_cond_wait(&clone_idle_cond, &clone_idle_lock);
+		const int finished = ! __atomic_load_n(&clone_pending, __ATOMIC_RELAXED);
+		(void) pthread_mutex_unlock(&clone_idle_lock);
+
+		if (finished)
+			break;
+	}
+
+	return NULL;
+}
+
+static int clone_remove_entry(const char* const path, const struct stat* const st, const int type, struct FTW* const ftw)
+{
+	(void) st;
+	(void) ftw;
+
+	if (type == FTW_DP)
+		(void) rmdir(path);
+	else
+		(void) unlink(path);
+
+	return 0;
+}
+
+static void clone_remove(const char* const path)
+{
+	(void) nftw(path, clone_remove_entry, 64, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+}
+
+int anschroot_clone_parse_mode(const char* const mode)
+{
+	if (! mode || ! strcmp(mode, "reflink"))
+		clone_mode = CLONE_REFLINK;
+	else if (! strcmp(mode, "copy"))
+		clone_mode = CLONE_COPY;
+	else if (! strcmp(mode, "hardlink"))
+		clone_mode = CLONE_HARDLINK;
+	else
+		return -1;
+
+	return 0;
+}
+
+/* Clone the root at src to a new directory next to it (named after src and our PID), whose
+ * path is written to dst.
+ */
+int anschroot_clone_create(const char* const src, char* const dst, const size_t dst_len)
+{
+	(void) snprintf(dst, dst_len, "%s.clone.%ld", src, (long) getpid());
+
+	struct stat st;
+	if (stat(src, &st) != 0)
+		return -1;
+
+	if (mkdir(dst, 0700) != 0 || clone_metadata(src, dst, &st) != 0)
+		return -1;
+
+	clone_dir_later(dst, &st);
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	if (ncpus > CLONE_THREADS_MAX)
+		ncpus = CLONE_THREADS_MAX;
+
+	for (long i = 0; i < ncpus; i++)
+		(void) pthread_mutex_init(&clone_workers[i].lock, NULL);
+
+	clone_workers_count = (unsigned int) ncpus;
+
+	char* const src_copy = strdup(src);
+	char* const dst_copy = strdup(dst);
+	if (! src_copy || ! dst_copy || clone_push(&clone_workers[0], src_copy, dst_copy) != 0)
+	{
+		free(src_copy);
+		free(dst_copy);
+		clone_remove(dst);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	unsigned int started = 0;
+	for (unsigned int i = 0; i < clone_workers_count; i++)
+		if (pthread_create(&clone_workers[i].thread, NULL, clone_worker, (void*) (uintptr_t) i) == 0)
+			started |= 1U << i;
+
+	for (unsigned int i = 0; i < clone_workers_count; i++)
+		if (started & (1U << i))
+			(void) pthread_join(clone_workers[i].thread, NULL);
+
+	// Every thread failed to start, so nobody took the first job
+	if (! started)
+		clone_fail(EAGAIN);
+
+	for (unsigned int i = 0; i < clone_workers_count; i++)
+	{
+		struct clone_job job;
+		while (clone_pop(&clone_workers[i], &job))
+		{
+			free(job.src);
+			free(job.dst);
+		}
+
+		free(clone_workers[i].jobs);
+		(void) pthread_mutex_destroy(&clone_workers[i].lock);
+	}
+
+	for (size_t i = 0; i < CLONE_LINKS_SIZE; i++)
+	{
+		while (clone_links[i])
+		{
+			struct clone_link* const next = clone_links[i]->next;
+			free(clone_links[i]);
+			clone_links[i] = next;
+		}
+	}
+
+	while (clone_dirs)
+	{
+		struct clone_dir* const next = clone_dirs->next;
+		(void) utimensat(AT_FDCWD, clone_dirs->path, clone_dirs->times, AT_SYMLINK_NOFOLLOW);
+		free(clone_dirs);
+		clone_dirs = next;
+	}
+
+	if (clone_error)
+	{
+		clone_remove(dst);
+		errno = clone_error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Remove the clone in the background, so that we can return to our caller immediately.
+ *
+ * The remover switches back to the host's mount namespace (hostns_fd) first; in ours, the
+ * clone still has filesystems mounted inside it.
+ */
+void anschroot_clone_remove_async(const char* const path, const int hostns_fd)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: fork(2): %s\n", strerror(errno));
+		return;
+	}
+
+	if (pid > 0)
+	{
+		(void) waitpid(pid, NULL, 0);
+		return;
+	}
+
+	// Detach completely (our parent is about to exit), and stay out of everyone else's way
+	if (setsid() == -1 || fork() != 0)
+		_exit(EXIT_SUCCESS);
+
+	(void) setpriority(PRIO_PROCESS, 0, 19);
+
+	if (setns(hostns_fd, CLONE_NEWNS) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: setns(2): %s\n", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	clone_remove(path);
+	_exit(EXIT_SUCCESS);
+}
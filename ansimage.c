@@ -0,0 +1,186 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/loop.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+extern int  anschroot_loop_attach(const int backingfd, const uint32_t lo_flags, char* const loopdev, const size_t loopdev_len);
+
+/* Where the image, its writable upper layer and the resulting root are staged.
+ *
+ * A tmpfs is mounted here in our (private) mount namespace, so concurrent sessions
+ * all use the same directory without seeing each other's mounts.
+ */
+#define IMAGE_STAGE_DIR         "/run/anschroot"
+#define IMAGE_STAGE_PATH        IMAGE_STAGE_DIR "/image"
+
+#define EROFS_SUPER_OFFSET      1024
+#define EROFS_SUPER_MAGIC_V1    0xE0F5E1E2U
+#define SQUASHFS_MAGIC          0x73717368U
+
+static const char* image_fstype(const int fd)
+{
+	uint32_t magic = 0;
+
+	if (pread(fd, &magic, sizeof magic, 0) == (ssize_t) sizeof magic && magic == SQUASHFS_MAGIC)
+		return "squashfs";
+
+	if (pread(fd, &magic, sizeof magic, EROFS_SUPER_OFFSET) == (ssize_t) sizeof magic && magic == EROFS_SUPER_MAGIC_V1)
+		return "erofs";
+
+	return NULL;
+}
+
+/* Look for a read-only loop device that is already backed by this image (e.g. one set up by a
+ * concurrent session of the same image), so that every session mounts the same block device and
+ * thus shares a single superblock and page cache.
+ */
+static int image_loop_find(const struct stat* const st, char* const loopdev, const size_t loopdev_len)
+{
+	DIR* dh = NULL;
+	if (! (dh = opendir("/sys/block")))
+		return -1;
+
+	int loopfd = -1;
+	struct dirent* de = NULL;
+	while ((de = readdir(dh)))
+	{
+		if (strncmp(de->d_name, "loop", 4) != 0)
+			continue;
+
+		(void) snprintf(loopdev, loopdev_len, "/dev/%s", de->d_name);
+
+		int fd = -1;
+		if ((fd = open(loopdev, O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+
+		struct loop_info64 info;
+		memset(&info, 0x00, sizeof info);
+
+		if (ioctl(fd, LOOP_GET_STATUS64, &info) == 0 && info.lo_device == st->st_dev &&
+		    info.lo_inode == st->st_ino && (info.lo_flags & LO_FLAGS_READ_ONLY))
+		{
+			loopfd = fd;
+			break;
+		}
+
+		(void) close(fd);
+	}
+	(void) closedir(dh);
+
+	return loopfd;
+}
+
+static int image_mkdir(const char* const path)
+{
+	if (mkdir(path, 0755) != 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+/* Loop-mount the image read-only and layer a writable tmpfs over it with overlayfs.
+ *
+ * The path of the resulting root is written to vm_root_path. This must be called after
+ * the mount namespace has been unshared, or the host would see the mounts.
+ */
+int anschroot_image_mount(const char* const image_path, char* const vm_root_path, const size_t vm_root_path_len)
+{
+	char loopdev[PATH_MAX];
+	memset(loopdev, 0x00, sizeof loopdev);
+
+	int loopfd = -1;
+	int errsv = 0;
+
+	int imgfd = -1;
+	if ((imgfd = open(image_path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	struct stat st;
+	if (fstat(imgfd, &st) != 0)
+		goto fail;
+
+	const char* fstype = NULL;
+	if (! (fstype = image_fstype(imgfd)))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	// Serialise loop device setup against concurrent sessions of the same image
+	if (flock(imgfd, LOCK_EX) != 0)
+		goto fail;
+
+	if ((loopfd = image_loop_find(&st, loopdev, sizeof loopdev)) == -1)
+		if ((loopfd = anschroot_loop_attach(imgfd, LO_FLAGS_READ_ONLY, loopdev, sizeof loopdev)) == -1)
+			goto fail;
+
+	if (image_mkdir(IMAGE_STAGE_DIR) != 0 || image_mkdir(IMAGE_STAGE_PATH) != 0)
+		goto fail_loop;
+
+	if (mount("anschroot", IMAGE_STAGE_PATH, "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755") != 0)
+		goto fail_loop;
+
+	if (image_mkdir(IMAGE_STAGE_PATH "/lower") != 0 || image_mkdir(IMAGE_STAGE_PATH "/upper") != 0 ||
+	    image_mkdir(IMAGE_STAGE_PATH "/work") != 0 || image_mkdir(IMAGE_STAGE_PATH "/root") != 0)
+		goto fail_loop;
+
+	if (mount(loopdev, IMAGE_STAGE_PATH "/lower", fstype, MS_RDONLY, NULL) != 0)
+		goto fail_loop;
+
+	const char* const ovlopts = "lowerdir=" IMAGE_STAGE_PATH "/lower,upperdir=" IMAGE_STAGE_PATH "/upper,"
+	                            "workdir=" IMAGE_STAGE_PATH "/work";
+
+	if (mount("overlay", IMAGE_STAGE_PATH "/root", "overlay", 0, ovlopts) != 0)
+		goto fail_loop;
+
+	// The mount now holds its own reference to the loop device
+	(void) close(loopfd);
+	(void) close(imgfd);
+
+	(void) snprintf(vm_root_path, vm_root_path_len, "%s", IMAGE_STAGE_PATH "/root");
+	return 0;
+
+fail_loop:
+	errsv = errno;
+	(void) close(loopfd);
+	errno = errsv;
+
+fail:
+	errsv = errno;
+	(void) close(imgfd);
+	errno = errsv;
+
+	return -1;
+}
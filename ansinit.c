@@ -0,0 +1,155 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+
+/* A minimal init, for asynchronous teardown.
+ *
+ * Normally the executable is PID 1 of the session, and the parent can't collect its exit
+ * status until the kernel has torn the whole PID namespace down (killed and reaped every
+ * other process in it), which can take seconds after a big build. Instead, this stays on as
+ * PID 1, runs the executable as PID 2, and as soon as that exits, sends its status (and
+ * resource usage) straight to the parent, before exiting itself and so starting the
+ * teardown. Orphans are reaped along the way, as an init should.
+ */
+struct anschroot_init_status
+{
+	int             status;
+	struct rusage   ru;
+};
+
+/* As PID 1, we only get the signals we handle; the ones the parent passes on to us (see
+ * anschroot_forward_signal()) are passed on in turn.
+ */
+static volatile sig_atomic_t init_child = 0;
+
+static void init_forward_signal(const int sig)
+{
+	const int errsv = errno;
+
+	if (init_child > 0)
+		(void) kill((pid_t) init_child, sig);
+
+	errno = errsv;
+}
+
+/* Run exec_arg as our only child. Called with SIGHUP, SIGINT and SIGTERM blocked. */
+int anschroot_init_run(char* const exec_arg, const int statusfd)
+{
+	const struct sigaction forward = { .sa_handler = init_forward_signal, .sa_flags = SA_RESTART };
+	sigset_t sigmask;
+
+	(void) sigemptyset(&sigmask);
+	(void) sigaddset(&sigmask, SIGHUP);
+	(void) sigaddset(&sigmask, SIGINT);
+	(void) sigaddset(&sigmask, SIGTERM);
+
+	(void) sigaction(SIGHUP, &forward, NULL);
+	(void) sigaction(SIGINT, &forward, NULL);
+	(void) sigaction(SIGTERM, &forward, NULL);
+
+	const pid_t pid = fork();
+	if (pid < 0)
+	{
+		(void) fprintf(stderr, "nschroot[init]: fork(2): %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (pid == 0)
+	{
+		(void) sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+
+		if (execv(exec_arg, (char* const []) { exec_arg, NULL }) != 0)
+			(void) fprintf(stderr, "nschroot[child]: execv(3): %s\n", strerror(errno));
+
+		_exit(EXIT_FAILURE);
+	}
+
+	init_child = (sig_atomic_t) pid;
+	(void) sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+
+	// Let go of everything else inherited from the parent, so that it sees EOF where it should
+	if (statusfd > 3)
+		(void) syscall(SYS_close_range, 3U, (unsigned int) statusfd - 1, 0U);
+	(void) syscall(SYS_close_range, (unsigned int) statusfd + 1, ~0U, 0U);
+
+	struct anschroot_init_status msg;
+	(void) memset(&msg, 0x00, sizeof msg);
+
+	for (;;)
+	{
+		int status = 0;
+		const pid_t reaped = wait(&status);
+
+		if (reaped == pid)
+		{
+			msg.status = status;
+			break;
+		}
+
+		if (reaped == -1 && errno != EINTR)
+		{
+			msg.status = W_EXITCODE(EXIT_FAILURE, 0);
+			break;
+		}
+	}
+
+	(void) getrusage(RUSAGE_CHILDREN, &msg.ru);
+
+	if (write(statusfd, &msg, sizeof msg) != (ssize_t) sizeof msg)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+/* In the parent; wait for the status of the executable from the init. Returns -1 if the init
+ * died without sending it.
+ */
+int anschroot_init_wait(const int statusfd, int* const status, struct rusage* const ru)
+{
+	struct anschroot_init_status msg;
+	ssize_t ret = 0;
+
+	while ((ret = read(statusfd, &msg, sizeof msg)) == -1 && errno == EINTR)
+		continue;
+
+	if (ret != (ssize_t) sizeof msg)
+		return -1;
+
+	*status = msg.status;
+	*ru = msg.ru;
+
+	return 0;
+}
@@ -26,7 +26,16 @@
 #include <sys/mount.h>
 #include <sys/types.h>
 
-#define VM_MOUNTS_COUNT 6
+/* Note that /var/tmp/portage is not in this list; its backend is chosen per session (see
+ * ansscratch.c).
+ *
+ * The propagation type is applied to each mount after it is made (0 leaves it as inherited
+ * from the mount it is made under). These mounts belong to the session alone, so they are
+ * all made private, so that nothing mounted under them later propagates anywhere. That can't
+ * undo the propagation of the mount itself, though: with --propagation=unchanged, each one
+ * has already appeared in the host's peer mounts by the time it is made private.
+ */
+#define VM_MOUNTS_COUNT 5
 
 static const struct vm_mount {
 	const char*     source;
@@ -34,13 +43,13 @@ static const struct vm_mount {
 	const char*     fstype;
 	const char*     fsopts;
 	unsigned long   mflags;
+	unsigned long   propagation;
 } vm_mounts[VM_MOUNTS_COUNT] = {
-	{ "devpts", "/dev/pts", "devpts", "newinstance,ptmxmode=0666,mode=0600,gid=5", MS_NOSUID | MS_NOEXEC },
-	{ "shm", "/dev/shm", "tmpfs", "size=256M,nr_inodes=16k,mode=1777", MS_NOSUID | MS_NOEXEC | MS_NODEV },
-	{ "proc", "/proc", "proc", NULL, MS_NOSUID | MS_NOEXEC | MS_NODEV },
-	{ "runfs", "/run", "tmpfs", "size=8M,nr_inodes=8k,mode=1775,gid=500", MS_NOSUID | MS_NOEXEC },
-	{ "tmpfs", "/tmp", "tmpfs", "size=256M,nr_inodes=16k,mode=1777", MS_NOSUID },
-	{ "tmpfs", "/var/tmp/portage", "tmpfs", "size=2G,nr_inodes=256k,mode=0755,uid=250,gid=250", MS_NOSUID },
+	{ "devpts", "/dev/pts", "devpts", "newinstance,ptmxmode=0666,mode=0600,gid=5", MS_NOSUID | MS_NOEXEC, MS_PRIVATE },
+	{ "shm", "/dev/shm", "tmpfs", "size=256M,nr_inodes=16k,mode=1777", MS_NOSUID | MS_NOEXEC | MS_NODEV, MS_PRIVATE },
+	{ "proc", "/proc", "proc", NULL, MS_NOSUID | MS_NOEXEC | MS_NODEV, MS_PRIVATE },
+	{ "runfs", "/run", "tmpfs", "size=8M,nr_inodes=8k,mode=1775,gid=500", MS_NOSUID | MS_NOEXEC, MS_PRIVATE },
+	{ "tmpfs", "/tmp", "tmpfs", "size=256M,nr_inodes=16k,mode=1777", MS_NOSUID, MS_PRIVATE },
 };
 
 int anschroot_mount_paths_inroot(const char* const vm_root_path)
@@ -58,6 +67,9 @@ int anschroot_mount_paths_inroot(const char* const vm_root_path)
 
 		if (mount(source, target, fstype, mflags, fsopts) != 0)
 			return -1;
+
+		if (vm_mounts[i].propagation && mount(NULL, target, NULL, vm_mounts[i].propagation, NULL) != 0)
+			return -1;
 	}
 
 	return 0;
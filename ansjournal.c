@@ -0,0 +1,441 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* The change journal.
+ *
+ * Lists every path in the root that was created, modified or deleted (or moved to or from)
+ * while the session ran, so that whatever consumes the root afterwards (a sync, a snapshot,
+ * a cache) only needs to look at those, rather than scanning the whole tree.
+ *
+ * The filesystem the root is on is marked with fanotify, reporting each change as the handle
+ * of the directory it happened in plus the name of the entry. Changes are deduplicated on
+ * that pair as they arrive, and each pair is only resolved into a path (which is expensive)
+ * the first time it is seen. Changes outside the root (it's a filesystem-wide mark) are
+ * remembered as such, and so filtered out just as cheaply.
+ *
+ * The journal is written as "<flags> <path>" lines, with paths relative to the root and
+ * flags from C (created or moved in), M (modified) and D (deleted or moved out). If the
+ * kernel's event queue overflowed (it's left at its default size, rather than letting a busy
+ * filesystem pin unbounded kernel memory), or more distinct changes were seen than are kept
+ * track of, the first line is "!", and the journal is incomplete.
+ */
+#define JOURNAL_MASK            (FAN_CREATE | FAN_MODIFY | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+#define JOURNAL_CREATED         0x01U
+#define JOURNAL_MODIFIED        0x02U
+#define JOURNAL_DELETED         0x04U
+#define JOURNAL_BUF_SIZE        65536
+#define JOURNAL_ENTRIES_MAX     (1U << 20)
+
+struct journal_entry
+{
+	char*                   path;           // NULL if outside the root (or unresolvable)
+	unsigned int            flags;
+	size_t                  key_len;
+	unsigned char           key[];
+};
+
+static struct journal_entry**   journal_entries = NULL;
+static size_t                   journal_entries_size = 0;
+static size_t                   journal_entries_count = 0;
+static int                      journal_overflow = 0;
+static int                      journal_fanfd = -1;
+static int                      journal_rootfd = -1;
+static int                      journal_procfd = -1;
+static char                     journal_root[PATH_MAX];
+static pthread_t                journal_thread;
+static int                      journal_thread_started = 0;
+static int                      journal_stopfds[2] = { -1, -1 };
+
+static uint64_t journal_hash(const unsigned char* const key, const size_t key_len)
+{
+	// FNV-1a
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (size_t i = 0; i < key_len; i++)
+		hash = (hash ^ key[i]) * 0x100000001B3ULL;
+
+	return hash;
+}
+
+static int journal_grow(void)
+{
+	const size_t size_new = journal_entries_size ? (journal_entries_size * 2) : 4096;
+	struct journal_entry** entries_new = calloc(size_new, sizeof(*entries_new));
+	if (! entries_new)
+		return -1;
+
+	for (size_t i = 0; i < journal_entries_size; i++)
+	{
+		struct journal_entry* const entry = journal_entries[i];
+		if (! entry)
+			continue;
+
+		size_t j = journal_hash(entry->key, entry->key_len) & (size_new - 1);
+		while (entries_new[j])
+			j = (j + 1) & (size_new - 1);
+
+		entries_new[j] = entry;
+	}
+
+	free(journal_entries);
+	journal_entries = entries_new;
+	journal_entries_size = size_new;
+
+	return 0;
+}
+
+// The path of name in the directory with the given handle, if it's in the root
+static char* journal_resolve(struct file_handle* const handle, const char* const name)
+{
+	int dirfd = -1;
+	if ((dirfd = open_by_handle_at(journal_rootfd, handle, O_PATH | O_CLOEXEC)) == -1)
+		return NULL;
+
+	char fdpath[64];
+	char dirpath[PATH_MAX];
+	(void) snprintf(fdpath, sizeof fdpath, "fd/%d", dirfd);
+
+	const ssize_t dirpath_len = readlinkat(journal_procfd, fdpath, dirpath, sizeof dirpath - 1);
+	(void) close(dirfd);
+	if (dirpath_len <= 0)
+		return NULL;
+
+	dirpath[dirpath_len] = '\0';
+
+	const size_t root_len = strlen(journal_root);
+	if ((size_t) dirpath_len < root_len || memcmp(dirpath, journal_root, root_len) != 0)
+		return NULL;
+
+	if (dirpath[root_len] != '/' && dirpath[root_len] != '\0')
+		return NULL;
+
+	const char* const rel = dirpath + root_len;
+	char* path = NULL;
+
+	if (! *name)
+		path = strdup(*rel ? rel : "/");
+	else if (asprintf(&path, "%s/%s", rel, name) == -1)
+		path = NULL;
+
+	return path;
+}
+
+static void journal_add(const struct fanotify_event_info_fid* const fid, const char* const name, const unsigned int flags)
+{
+	// Copy the handle out, as it needn't be suitably aligned within the event
+	union
+	{
+		struct file_handle      handle;
+		unsigned char           buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} fh;
+
+	(void) memcpy(&fh.handle, fid->handle, sizeof fh.handle);
+	if (fh.handle.handle_bytes > MAX_HANDLE_SZ)
+		return;
+
+	(void) memcpy(fh.handle.f_handle, fid->handle + sizeof fh.handle, fh.handle.handle_bytes);
+
+	// The key is the handle (type and bytes) followed by the name
+	unsigned char key[sizeof(int) + MAX_HANDLE_SZ + NAME_MAX + 1];
+	const size_t name_len = strlen(name);
+	if (name_len > NAME_MAX)
+		return;
+
+	size_t key_len = 0;
+	(void) memcpy(key, &fh.handle.handle_type, sizeof(int));
+	key_len += sizeof(int);
+	(void) memcpy(key + key_len, fh.handle.f_handle, fh.handle.handle_bytes);
+	key_len += fh.handle.handle_bytes;
+	(void) memcpy(key + key_len, name, name_len);
+	key_len += name_len;
+
+	// Once full, the table stops growing, but the entries already in it are still updated
+	if (journal_entries_count < JOURNAL_ENTRIES_MAX && (journal_entries_count + 1) * 2 > journal_entries_size &&
+	    journal_grow() != 0)
+	{
+		journal_overflow = 1;
+		return;
+	}
+
+	size_t i = journal_hash(key, key_len) & (journal_entries_size - 1);
+	while (journal_entries[i])
+	{
+		struct journal_entry* const entry = journal_entries[i];
+		if (entry->key_len == key_len && ! memcmp(entry->key, key, key_len))
+		{
+			entry->flags |= flags;
+			return;
+		}
+
+		i = (i + 1) & (journal_entries_size - 1);
+	}
+
+	if (journal_entries_count >= JOURNAL_ENTRIES_MAX)
+	{
+		journal_overflow = 1;
+		return;
+	}
+
+	struct journal_entry* const entry = malloc(sizeof(*entry) + key_len);
+	if (! entry)
+	{
+		journal_overflow = 1;
+		return;
+	}
+
+	entry->path = journal_resolve(&fh.handle, name);
+	entry->flags = flags;
+	entry->key_len = key_len;
+	(void) memcpy(entry->key, key, key_len);
+
+	journal_entries[i] = entry;
+	journal_entries_count++;
+}
+
+static void journal_event(const struct fanotify_event_metadata* const ev)
+{
+	if (ev->mask & FAN_Q_OVERFLOW)
+	{
+		journal_overflow = 1;
+		return;
+	}
+
+	unsigned int flags = 0;
+	if (ev->mask & (FAN_CREATE | FAN_MOVED_TO))
+		flags |= JOURNAL_CREATED;
+	if (ev->mask & FAN_MODIFY)
+		flags |= JOURNAL_MODIFIED;
+	if (ev->mask & (FAN_DELETE | FAN_MOVED_FROM))
+		flags |= JOURNAL_DELETED;
+
+	const unsigned char* info = (const unsigned char*) ev + ev->metadata_len;
+	const unsigned char* const end = (const unsigned char*) ev + ev->event_len;
+
+	while (info + sizeof(struct fanotify_event_info_header) <= end)
+	{
+		const struct fanotify_event_info_fid* const fid = (const struct fanotify_event_info_fid*) info;
+		if (! fid->hdr.len)
+			break;
+
+		if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID)
+		{
+			const char* name = "";
+
+			if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+			{
+				struct file_handle handle;
+				(void) memcpy(&handle, fid->handle, sizeof handle);
+				name = (const char*) fid->handle + sizeof handle + handle.handle_bytes;
+			}
+
+			journal_add(fid, name, flags);
+		}
+
+		info += fid->hdr.len;
+	}
+}
+
+static void* journal_worker(void* const arg)
+{
+	(void) arg;
+
+	struct pollfd pfds[2] = {
+		{ .fd = journal_fanfd, .events = POLLIN },
+		{ .fd = journal_stopfds[0], .events = POLLIN },
+	};
+
+	char* buf = NULL;
+	if (! (buf = aligned_alloc(__alignof__(struct fanotify_event_metadata), JOURNAL_BUF_SIZE)))
+	{
+		journal_overflow = 1;
+		return NULL;
+	}
+
+	for (;;)
+	{
+		if (poll(pfds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		// Drain the queue before honouring the stop request
+		if (! (pfds[0].revents & POLLIN))
+		{
+			if (pfds[1].revents)
+				break;
+
+			continue;
+		}
+
+		const ssize_t buflen = read(journal_fanfd, buf, JOURNAL_BUF_SIZE);
+		if (buflen <= 0)
+			continue;
+
+		const struct fanotify_event_metadata* ev = (const struct fanotify_event_metadata*) buf;
+		for (ssize_t evlen = buflen; FAN_EVENT_OK(ev, evlen); ev = FAN_EVENT_NEXT(ev, evlen))
+			journal_event(ev);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Start journalling changes to the filesystem that vm_root_path is on. This is done before
+ * the child is forked, so that nothing it does is missed.
+ */
+int anschroot_journal_open(const char* const vm_root_path)
+{
+	(void) snprintf(journal_root, sizeof journal_root, "%s", vm_root_path);
+
+	// Get hold of these before the child unmounts /proc (it's shared with us)
+	if ((journal_procfd = open("/proc/self", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+
+	if ((journal_rootfd = open(vm_root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+
+	const unsigned int fan_flags = FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME;
+	if ((journal_fanfd = fanotify_init(fan_flags, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	if (fanotify_mark(journal_fanfd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, JOURNAL_MASK, journal_rootfd, NULL) != 0)
+		return -1;
+
+	return 0;
+}
+
+/* Start reading the events (in the background) */
+int anschroot_journal_start(void)
+{
+	if (pipe2(journal_stopfds, O_CLOEXEC) != 0)
+		return -1;
+
+	if ((errno = pthread_create(&journal_thread, NULL, journal_worker, NULL)) != 0)
+		return -1;
+
+	journal_thread_started = 1;
+	return 0;
+}
+
+static int journal_compare(const void* const a, const void* const b)
+{
+	const struct journal_entry* const ea = *(const struct journal_entry* const*) a;
+	const struct journal_entry* const eb = *(const struct journal_entry* const*) b;
+
+	return strcmp(ea->path, eb->path);
+}
+
+/* Stop journalling, and write the journal to name in dirfd */
+int anschroot_journal_finish(const int dirfd, const char* const name)
+{
+	if (journal_thread_started)
+	{
+		(void) close(journal_stopfds[1]);
+		(void) pthread_join(journal_thread, NULL);
+		(void) close(journal_stopfds[0]);
+		journal_thread_started = 0;
+	}
+
+	if (journal_fanfd != -1)
+		(void) close(journal_fanfd);
+	if (journal_rootfd != -1)
+		(void) close(journal_rootfd);
+	if (journal_procfd != -1)
+		(void) close(journal_procfd);
+
+	journal_fanfd = journal_rootfd = journal_procfd = -1;
+
+	// Collect the entries in the root, sorted by path
+	size_t count = 0;
+	for (size_t i = 0; i < journal_entries_size; i++)
+		if (journal_entries[i] && journal_entries[i]->path)
+			journal_entries[count++] = journal_entries[i];
+		else if (journal_entries[i])
+			free(journal_entries[i]);
+
+	qsort(journal_entries, count, sizeof(*journal_entries), journal_compare);
+
+	char tmpname[NAME_MAX + 1];
+	(void) snprintf(tmpname, sizeof tmpname, ".%s.%ld", name, (long) getpid());
+
+	int fd = -1;
+	FILE* fh = NULL;
+	int ret = -1;
+
+	if ((fd = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) != -1 && (fh = fdopen(fd, "w")))
+	{
+		if (journal_overflow)
+			(void) fprintf(fh, "!\n");
+
+		for (size_t i = 0; i < count; i++)
+		{
+			const unsigned int flags = journal_entries[i]->flags;
+
+			(void) fprintf(fh, "%s%s%s %s\n", (flags & JOURNAL_CREATED) ? "C" : "", (flags & JOURNAL_MODIFIED) ? "M" : "",
+			               (flags & JOURNAL_DELETED) ? "D" : "", journal_entries[i]->path);
+		}
+
+		ret = (fclose(fh) == 0) ? 0 : -1;
+		fd = -1;
+	}
+	else if (fd != -1)
+	{
+		(void) close(fd);
+	}
+
+	if (! ret)
+		ret = renameat(dirfd, tmpname, dirfd, name);
+
+	const int errsv = errno;
+	if (ret)
+		(void) unlinkat(dirfd, tmpname, 0);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		free(journal_entries[i]->path);
+		free(journal_entries[i]);
+	}
+	free(journal_entries);
+	journal_entries = NULL;
+	journal_entries_size = journal_entries_count = 0;
+
+	errno = errsv;
+
+	return ret;
+}
@@ -0,0 +1,95 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/loop.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Attach backingfd to a free loop device, returning an open descriptor for the device and
+ * writing its path to loopdev.
+ *
+ * The device is always auto-cleared, so that it goes away once nothing uses it any more, and
+ * uses direct I/O where possible, so that the data is not cached twice (once for the backing
+ * file and once for the loop device).
+ */
+int anschroot_loop_attach(const int backingfd, const uint32_t lo_flags, char* const loopdev, const size_t loopdev_len)
+{
+	int ctlfd = -1;
+	if ((ctlfd = open("/dev/loop-control", O_RDWR | O_CLOEXEC)) == -1)
+		return -1;
+
+	int loopfd = -1;
+	for (;;)
+	{
+		int loopnr = -1;
+		if ((loopnr = ioctl(ctlfd, LOOP_CTL_GET_FREE)) < 0)
+			break;
+
+		(void) snprintf(loopdev, loopdev_len, "/dev/loop%d", loopnr);
+
+		if ((loopfd = open(loopdev, ((lo_flags & LO_FLAGS_READ_ONLY) ? O_RDONLY : O_RDWR) | O_CLOEXEC)) == -1)
+			break;
+
+		struct loop_config config;
+		memset(&config, 0x00, sizeof config);
+		config.fd = (uint32_t) backingfd;
+		config.info.lo_flags = lo_flags | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+
+		if (ioctl(loopfd, LOOP_CONFIGURE, &config) == 0)
+			break;
+
+		// Kernels older than 5.8 don't have LOOP_CONFIGURE
+		if (errno == EINVAL || errno == ENOTTY)
+		{
+			if (ioctl(loopfd, LOOP_SET_FD, backingfd) == 0)
+			{
+				struct loop_info64 info;
+				memset(&info, 0x00, sizeof info);
+				info.lo_flags = lo_flags | LO_FLAGS_AUTOCLEAR;
+
+				if (ioctl(loopfd, LOOP_SET_STATUS64, &info) == 0)
+					break;
+
+				(void) ioctl(loopfd, LOOP_CLR_FD, 0);
+			}
+		}
+
+		(void) close(loopfd);
+		loopfd = -1;
+
+		// Somebody else grabbed this device before we could configure it; try the next one
+		if (errno != EBUSY)
+			break;
+	}
+
+	int errsv = errno;
+	(void) close(ctlfd);
+	errno = errsv;
+
+	return loopfd;
+}
@@ -0,0 +1,857 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+extern void anschroot_sha256(const void* const data, const size_t len, uint8_t* const digest);
+
+/* Integrity manifests.
+ *
+ * A manifest lists everything in a root (not crossing into other filesystems mounted in it),
+ * sorted by path, with its type, permissions, ownership and size, and for regular files and
+ * symbolic links a digest of their contents (or target). A root can be verified against one
+ * before it is entered, so that a corrupted or tampered-with toolchain is never run.
+ *
+ * File digests are tree hashes: each MANIFEST_CHUNK of a file is hashed with SHA-256, and the
+ * digest is the SHA-256 of those chunk digests, in order. This lets the chunks of one large
+ * file be hashed by several threads at once. (It is not the same as sha256sum's output.)
+ *
+ * The tree is walked and hashed by a pool of threads sharing one queue, holding directories
+ * still to be read and chunks of large files still to be hashed; small files are hashed by
+ * the thread that finds them.
+ *
+ * Every entry also records the file's inode number, modification and change times. With
+ * --incremental, a file for which all of these and its size are unchanged since the manifest
+ * was written is not read again, and its digest in the manifest is taken as is. (The change
+ * time can't be set from user space, so a file can't be modified behind the manifest's back
+ * this way, short of changing the system clock or the raw block device.) That doesn't hold
+ * for the files in an image, which can all be changed by writing to the image file, so
+ * --incremental is refused for images.
+ */
+#define MANIFEST_THREADS_MAX    16
+#define MANIFEST_CHUNK          (1024 * 1024)
+#define MANIFEST_DIGEST_LEN     32
+#define MANIFEST_HEADER         "# anschroot manifest 1"
+#define MANIFEST_REPORT_MAX     20
+
+struct manifest_entry
+{
+	char*                   path;           // Relative to the root; "/" is the root itself
+	char                    type;
+	unsigned int            mode;
+	unsigned long           uid;
+	unsigned long           gid;
+	unsigned long long      size;           // Or the device number, for device nodes
+	unsigned long long      ino;
+	struct timespec         mtime;
+	struct timespec         ctime;
+	int                     hashed;
+	uint8_t                 digest[MANIFEST_DIGEST_LEN];
+	uint8_t*                chunks;
+	size_t                  chunks_left;
+};
+
+struct manifest_job
+{
+	struct manifest_entry*  entry;
+	size_t                  chunk;          // For regular files
+};
+
+struct manifest_list
+{
+	struct manifest_entry** entries;
+	size_t                  count;
+	size_t                  alloc;
+};
+
+static const char*              manifest_root = NULL;
+static dev_t                    manifest_root_dev = 0;
+static struct manifest_list     manifest_cached = { NULL, 0, 0 };
+static int                      manifest_incremental = 0;
+
+static pthread_mutex_t          manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           manifest_cond = PTHREAD_COND_INITIALIZER;
+static struct manifest_job*     manifest_jobs = NULL;
+static size_t                   manifest_jobs_count = 0;
+static size_t                   manifest_jobs_alloc = 0;
+static unsigned int             manifest_busy = 0;
+static int                      manifest_error = 0;
+static struct manifest_list     manifest_found = { NULL, 0, 0 };
+
+static void manifest_entry_free(struct manifest_entry* const entry)
+{
+	if (! entry)
+		return;
+
+	free(entry->path);
+	free(entry->chunks);
+	free(entry);
+}
+
+static void manifest_list_free(struct manifest_list* const list)
+{
+	for (size_t i = 0; i < list->count; i++)
+		manifest_entry_free(list->entries[i]);
+
+	free(list->entries);
+	list->entries = NULL;
+	list->count = list->alloc = 0;
+}
+
+static int manifest_list_add(struct manifest_list* const list, struct manifest_entry* const entry)
+{
+	if (list->count == list->alloc)
+	{
+		const size_t alloc_new = list->alloc ? (list->alloc * 2) : 1024;
+		struct manifest_entry** entries_new = realloc(list->entries, alloc_new * sizeof(*entries_new));
+		if (! entries_new)
+			return -1;
+
+		list->entries = entries_new;
+		list->alloc = alloc_new;
+	}
+
+	list->entries[list->count++] = entry;
+	return 0;
+}
+
+static int manifest_compare(const void* const a, const void* const b)
+{
+	return strcmp((*(struct manifest_entry* const*) a)->path, (*(struct manifest_entry* const*) b)->path);
+}
+
+static struct manifest_entry* manifest_lookup(const struct manifest_list* const list, const char* const path)
+{
+	const struct manifest_entry key = { .path = (char*) path };
+	const struct manifest_entry* const keyp = &key;
+
+	struct manifest_entry** const found = bsearch(&keyp, list->entries, list->count, sizeof(*list->entries), manifest_compare);
+
+	return found ? *found : NULL;
+}
+
+// Called with manifest_lock held
+static void manifest_fail(const int err)
+{
+	if (! manifest_error)
+		manifest_error = err;
+
+	(void) pthread_cond_broadcast(&manifest_cond);
+}
+
+// Called with manifest_lock held
+static int manifest_push(struct manifest_entry* const entry, const size_t chunk)
+{
+	if (manifest_jobs_count == manifest_jobs_alloc)
+	{
+		const size_t alloc_new = manifest_jobs_alloc ? (manifest_jobs_alloc * 2) : 256;
+		struct manifest_job* jobs_new = realloc(manifest_jobs, alloc_new * sizeof(*jobs_new));
+		if (! jobs_new)
+			return -1;
+
+		manifest_jobs = jobs_new;
+		manifest_jobs_alloc = alloc_new;
+	}
+
+	manifest_jobs[manifest_jobs_count].entry = entry;
+	manifest_jobs[manifest_jobs_count].chunk = chunk;
+	manifest_jobs_count++;
+
+	(void) pthread_cond_signal(&manifest_cond);
+	return 0;
+}
+
+static char manifest_type(const mode_t mode)
+{
+	if (S_ISREG(mode))
+		return 'f';
+	if (S_ISDIR(mode))
+		return 'd';
+	if (S_ISLNK(mode))
+		return 'l';
+	if (S_ISCHR(mode))
+		return 'c';
+	if (S_ISBLK(mode))
+		return 'b';
+	if (S_ISFIFO(mode))
+		return 'p';
+
+	return 's';
+}
+
+static int manifest_open(const int dirfd, const char* const name)
+{
+	// Don't update access times all over the root just by checking it
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+	if (fd == -1 && errno == EPERM)
+		fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+	return fd;
+}
+
+// Hash a chunk of a regular file, at offset; returns the number of bytes hashed
+static ssize_t manifest_hash_chunk(const int fd, const off_t offset, uint8_t* const buf, uint8_t* const digest)
+{
+	size_t len = 0;
+
+	while (len < MANIFEST_CHUNK)
+	{
+		const ssize_t ret = pread(fd, buf + len, MANIFEST_CHUNK - len, offset + (off_t) len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+
+		len += (size_t) ret;
+	}
+
+	anschroot_sha256(buf, len, digest);
+	return (ssize_t) len;
+}
+
+static void manifest_hash_finish(struct manifest_entry* const entry, const size_t chunks)
+{
+	anschroot_sha256(entry->chunks, chunks * MANIFEST_DIGEST_LEN, entry->digest);
+	entry->hashed = 1;
+
+	free(entry->chunks);
+	entry->chunks = NULL;
+}
+
+static int manifest_hash_file(struct manifest_entry* const entry, const int dirfd, const char* const name, uint8_t* const buf)
+{
+	const size_t chunks = entry->size ? ((entry->size + MANIFEST_CHUNK - 1) / MANIFEST_CHUNK) : 1;
+
+	if (! (entry->chunks = malloc(chunks * MANIFEST_DIGEST_LEN)))
+		return -1;
+
+	// Large files are handed out to the pool a chunk at a time
+	if (chunks > 1)
+	{
+		entry->chunks_left = chunks;
+
+		int ret = 0;
+		(void) pthread_mutex_lock(&manifest_lock);
+		for (size_t i = 0; i < chunks && ! ret; i++)
+			ret = manifest_push(entry, i);
+		(void) pthread_mutex_unlock(&manifest_lock);
+
+		return ret;
+	}
+
+	int fd = -1;
+	if ((fd = manifest_open(dirfd, name)) == -1)
+		return -1;
+
+	const ssize_t ret = manifest_hash_chunk(fd, 0, buf, entry->chunks);
+	const int errsv = errno;
+	(void) close(fd);
+
+	if (ret < 0)
+	{
+		errno = errsv;
+		return -1;
+	}
+
+	manifest_hash_finish(entry, 1);
+	return 0;
+}
+
+static int manifest_entry_stat(struct manifest_entry* const entry, const struct stat* const st)
+{
+	entry->type = manifest_type(st->st_mode);
+	entry->mode = (unsigned int) (st->st_mode & 07777);
+	entry->uid = (unsigned long) st->st_uid;
+	entry->gid = (unsigned long) st->st_gid;
+	entry->ino = (unsigned long long) st->st_ino;
+	entry->mtime = st->st_mtim;
+	entry->ctime = st->st_ctim;
+
+	if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+		entry->size = (unsigned long long) st->st_rdev;
+	else if (S_ISREG(st->st_mode) || S_ISLNK(st->st_mode))
+		entry->size = (unsigned long long) st->st_size;
+
+	return 0;
+}
+
+// Whether the entry can be taken from the old manifest as is
+static int manifest_unchanged(struct manifest_entry* const entry)
+{
+	const struct manifest_entry* const cached = manifest_lookup(&manifest_cached, entry->path);
+
+	if (! cached || ! cached->hashed || cached->type != entry->type || cached->size != entry->size ||
+	    cached->ino != entry->ino || cached->mtime.tv_sec != entry->mtime.tv_sec ||
+	    cached->mtime.tv_nsec != entry->mtime.tv_nsec || cached->ctime.tv_sec != entry->ctime.tv_sec ||
+	    cached->ctime.tv_nsec != entry->ctime.tv_nsec)
+		return 0;
+
+	(void) memcpy(entry->digest, cached->digest, sizeof entry->digest);
+	return 1;
+}
+
+static int manifest_entry(const int dirfd, const char* const dir, const char* const name, uint8_t* const buf)
+{
+	struct stat st;
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		return -1;
+
+	struct manifest_entry* entry = NULL;
+	if (! (entry = calloc(1, sizeof(*entry))))
+		return -1;
+
+	if (asprintf(&entry->path, "%s%s%s", dir, (dir[1] ? "/" : ""), name) == -1)
+	{
+		entry->path = NULL;
+		manifest_entry_free(entry);
+		return -1;
+	}
+
+	(void) manifest_entry_stat(entry, &st);
+
+	(void) pthread_mutex_lock(&manifest_lock);
+	int ret = manifest_list_add(&manifest_found, entry);
+	(void) pthread_mutex_unlock(&manifest_lock);
+
+	if (ret != 0)
+	{
+		manifest_entry_free(entry);
+		return -1;
+	}
+
+	// The entry belongs to the list from here on
+	if (S_ISDIR(st.st_mode))
+	{
+		// Other filesystems mounted in the root are not part of it
+		if (st.st_dev != manifest_root_dev)
+			return 0;
+
+		(void) pthread_mutex_lock(&manifest_lock);
+		ret = manifest_push(entry, 0);
+		(void) pthread_mutex_unlock(&manifest_lock);
+
+		return ret;
+	}
+
+	if (S_ISLNK(st.st_mode))
+	{
+		char target[PATH_MAX];
+		const ssize_t len = readlinkat(dirfd, name, target, sizeof target);
+		if (len < 0)
+			return -1;
+
+		anschroot_sha256(target, (size_t) len, entry->digest);
+		entry->hashed = 1;
+		return 0;
+	}
+
+	if (! S_ISREG(st.st_mode))
+		return 0;
+
+	if (manifest_incremental && manifest_unchanged(entry))
+	{
+		entry->hashed = 1;
+		return 0;
+	}
+
+	return manifest_hash_file(entry, dirfd, name, buf);
+}
+
+static void manifest_dir(const struct manifest_entry* const dir, uint8_t* const buf)
+{
+	char* path = NULL;
+	if (asprintf(&path, "%s%s", manifest_root, dir->path) == -1)
+	{
+		(void) pthread_mutex_lock(&manifest_lock);
+		manifest_fail(ENOMEM);
+		(void) pthread_mutex_unlock(&manifest_lock);
+		return;
+	}
+
+	DIR* dh = NULL;
+	if (! (dh = opendir(path)))
+	{
+		(void) fprintf(stderr, "nschroot[parent]: manifest: %s: %s\n", path, strerror(errno));
+		(void) pthread_mutex_lock(&manifest_lock);
+		manifest_fail(errno);
+		(void) pthread_mutex_unlock(&manifest_lock);
+		free(path);
+		return;
+	}
+
+	struct dirent* de = NULL;
+	while ((de = readdir(dh)) && ! __atomic_load_n(&manifest_error, __ATOMIC_RELAXED))
+	{
+		if (! strcmp(de->d_name, ".") || ! strcmp(de->d_name, ".."))
+			continue;
+
+		if (manifest_entry(dirfd(dh), dir->path, de->d_name, buf) != 0)
+		{
+			const int errsv = errno;
+			(void) fprintf(stderr, "nschroot[parent]: manifest: %s/%s: %s\n", path, de->d_name, strerror(errsv));
+			(void) pthread_mutex_lock(&manifest_lock);
+			manifest_fail(errsv);
+			(void) pthread_mutex_unlock(&manifest_lock);
+		}
+	}
+
+	(void) closedir(dh);
+	free(path);
+}
+
+static void manifest_chunk(struct manifest_entry* const entry, const size_t chunk, uint8_t* const buf)
+{
+	char* path = NULL;
+	int fd = -1;
+	ssize_t ret = -1;
+
+	if (asprintf(&path, "%s%s", manifest_root, entry->path) == -1)
+	{
+		path = NULL;
+		errno = ENOMEM;
+	}
+	else if ((fd = manifest_open(AT_FDCWD, path)) != -1)
+	{
+		ret = manifest_hash_chunk(fd, (off_t) chunk * MANIFEST_CHUNK, buf, entry->chunks + chunk * MANIFEST_DIGEST_LEN);
+		(void) close(fd);
+	}
+
+	if (ret < 0)
+	{
+		const int errsv = errno;
+		(void) fprintf(stderr, "nschroot[parent]: manifest: %s: %s\n", path ? path : entry->path, strerror(errsv));
+		(void) pthread_mutex_lock(&manifest_lock);
+		manifest_fail(errsv);
+		(void) pthread_mutex_unlock(&manifest_lock);
+	}
+	free(path);
+
+	// The last chunk of the file to be done finishes it
+	if (! __atomic_sub_fetch(&entry->chunks_left, 1, __ATOMIC_ACQ_REL) && ret >= 0)
+		manifest_hash_finish(entry, (entry->size + MANIFEST_CHUNK - 1) / MANIFEST_CHUNK);
+}
+
+static void* manifest_worker(void* const arg)
+{
+	uint8_t* const buf = arg;
+
+	(void) pthread_mutex_lock(&manifest_lock);
+
+	for (;;)
+	{
+		while (! manifest_jobs_count && manifest_busy && ! manifest_error)
+			(void) pthread_cond_wait(&manifest_cond, &manifest_lock);
+
+		// Finished, once there's nothing left to do and nobody is going to add anything
+		if (manifest_error || ! manifest_jobs_count)
+			break;
+
+		const struct manifest_job job = manifest_jobs[--manifest_jobs_count];
+		manifest_busy++;
+		(void) pthread_mutex_unlock(&manifest_lock);
+
+		if (job.entry->type == 'd')
+			manifest_dir(job.entry, buf);
+		else
+			manifest_chunk(job.entry, job.chunk, buf);
+
+		(void) pthread_mutex_lock(&manifest_lock);
+		if (! --manifest_busy && ! manifest_jobs_count)
+			(void) pthread_cond_broadcast(&manifest_cond);
+	}
+
+	(void) pthread_mutex_unlock(&manifest_lock);
+	return NULL;
+}
+
+// Walk and hash the tree at root, into manifest_found (sorted)
+static int manifest_scan(const char* const root)
+{
+	struct stat st;
+	if (lstat(root, &st) != 0)
+		return -1;
+
+	if (! S_ISDIR(st.st_mode))
+	{
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	manifest_root = root;
+	manifest_root_dev = st.st_dev;
+	manifest_error = 0;
+
+	struct manifest_entry* entry = NULL;
+	if (! (entry = calloc(1, sizeof(*entry))) || ! (entry->path = strdup("/")) ||
+	    manifest_list_add(&manifest_found, entry) != 0)
+	{
+		manifest_entry_free(entry);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	(void) manifest_entry_stat(entry, &st);
+
+	if (manifest_push(entry, 0) != 0)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	if (ncpus > MANIFEST_THREADS_MAX)
+		ncpus = MANIFEST_THREADS_MAX;
+
+	pthread_t threads[MANIFEST_THREADS_MAX];
+	uint8_t* bufs[MANIFEST_THREADS_MAX];
+	unsigned int started = 0;
+
+	for (long i = 0; i < ncpus; i++)
+	{
+		if (! (bufs[started] = malloc(MANIFEST_CHUNK)))
+			break;
+
+		if (pthread_create(&threads[started], NULL, manifest_worker, bufs[started]) != 0)
+		{
+			free(bufs[started]);
+			break;
+		}
+
+		started++;
+	}
+
+	for (unsigned int i = 0; i < started; i++)
+	{
+		(void) pthread_join(threads[i], NULL);
+		free(bufs[i]);
+	}
+
+	// Every thread failed to start, so nobody took the first job
+	if (! started)
+		manifest_error = EAGAIN;
+
+	free(manifest_jobs);
+	manifest_jobs = NULL;
+	manifest_jobs_count = manifest_jobs_alloc = 0;
+
+	if (manifest_error)
+	{
+		errno = manifest_error;
+		return -1;
+	}
+
+	qsort(manifest_found.entries, manifest_found.count, sizeof(*manifest_found.entries), manifest_compare);
+	return 0;
+}
+
+static void manifest_write_path(FILE* const fh, const char* str)
+{
+	for (; *str; str++)
+	{
+		if (*str == '\\')
+			(void) fputs("\\\\", fh);
+		else if (*str == '\n')
+			(void) fputs("\\n", fh);
+		else
+			(void) fputc(*str, fh);
+	}
+}
+
+static void manifest_write_entry(FILE* const fh, const struct manifest_entry* const entry)
+{
+	char digest[MANIFEST_DIGEST_LEN * 2 + 1] = "-";
+
+	if (entry->hashed)
+		for (size_t i = 0; i < MANIFEST_DIGEST_LEN; i++)
+			(void) snprintf(digest + i * 2, 3, "%02x", entry->digest[i]);
+
+	(void) fprintf(fh, "%c %04o %lu %lu %llu %s %llu %lld.%09ld %lld.%09ld ", entry->type, entry->mode, entry->uid,
+	               entry->gid, entry->size, digest, entry->ino, (long long) entry->mtime.tv_sec,
+	               entry->mtime.tv_nsec, (long long) entry->ctime.tv_sec, entry->ctime.tv_nsec);
+
+	manifest_write_path(fh, entry->path);
+	(void) fputc('\n', fh);
+}
+
+static int manifest_parse_digest(const char* const hex, uint8_t* const digest)
+{
+	if (! strcmp(hex, "-"))
+		return 0;
+
+	if (strlen(hex) != MANIFEST_DIGEST_LEN * 2)
+		return -1;
+
+	for (size_t i = 0; i < MANIFEST_DIGEST_LEN; i++)
+	{
+		unsigned int byte = 0;
+		if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+			return -1;
+
+		digest[i] = (uint8_t) byte;
+	}
+
+	return 1;
+}
+
+static struct manifest_entry* manifest_parse_entry(char* const line)
+{
+	struct manifest_entry* entry = NULL;
+	if (! (entry = calloc(1, sizeof(*entry))))
+		return NULL;
+
+	char digest[MANIFEST_DIGEST_LEN * 2 + 1];
+	long long mtime_sec = 0, ctime_sec = 0;
+	int offset = 0;
+
+	if (sscanf(line, "%c %o %lu %lu %llu %64s %llu %lld.%ld %lld.%ld %n", &entry->type, &entry->mode, &entry->uid,
+	           &entry->gid, &entry->size, digest, &entry->ino, &mtime_sec, &entry->mtime.tv_nsec, &ctime_sec,
+	           &entry->ctime.tv_nsec, &offset) != 11 || ! offset || line[offset] != '/' ||
+	    (entry->hashed = manifest_parse_digest(digest, entry->digest)) < 0 || ! (entry->path = strdup(line + offset)))
+	{
+		manifest_entry_free(entry);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	entry->mtime.tv_sec = (time_t) mtime_sec;
+	entry->ctime.tv_sec = (time_t) ctime_sec;
+
+	// Undo manifest_write_path()
+	char* out = entry->path;
+	for (const char* in = entry->path; *in; in++)
+	{
+		if (*in == '\\' && (in[1] == '\\' || in[1] == 'n'))
+			*out++ = (*++in == 'n') ? '\n' : '\\';
+		else
+			*out++ = *in;
+	}
+	*out = '\0';
+
+	return entry;
+}
+
+// Read a manifest into list (sorted)
+static int manifest_load(const char* const path, struct manifest_list* const list)
+{
+	FILE* fh = NULL;
+	if (! (fh = fopen(path, "re")))
+		return -1;
+
+	char* line = NULL;
+	size_t line_alloc = 0;
+	ssize_t len = 0;
+	int ret = 0;
+
+	while (! ret && (len = getline(&line, &line_alloc, fh)) != -1)
+	{
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (! len || line[0] == '#')
+			continue;
+
+		struct manifest_entry* const entry = manifest_parse_entry(line);
+		if (! entry || manifest_list_add(list, entry) != 0)
+		{
+			manifest_entry_free(entry);
+			ret = -1;
+		}
+	}
+
+	const int errsv = errno;
+	free(line);
+	(void) fclose(fh);
+
+	if (ret != 0)
+	{
+		manifest_list_free(list);
+		errno = errsv;
+		return -1;
+	}
+
+	qsort(list->entries, list->count, sizeof(*list->entries), manifest_compare);
+	return 0;
+}
+
+/* Write a manifest of the directory root to path (atomically, with a rename, so that a root
+ * is never checked against a partial one). With incremental, files that haven't changed since
+ * the manifest already at path was written aren't hashed again.
+ */
+int anschroot_manifest_generate(const char* const root, const char* const path, const int incremental)
+{
+	int ret = -1;
+	int errsv = 0;
+	FILE* fh = NULL;
+
+	char* tmppath = NULL;
+	if (asprintf(&tmppath, "%s.%ld", path, (long) getpid()) == -1)
+		return -1;
+
+	manifest_incremental = incremental;
+	if (incremental && manifest_load(path, &manifest_cached) != 0 && errno != ENOENT)
+		goto out;
+
+	if (manifest_scan(root) != 0)
+		goto out;
+
+	if (! (fh = fopen(tmppath, "we")))
+		goto out;
+
+	(void) fprintf(fh, "%s\n", MANIFEST_HEADER);
+	for (size_t i = 0; i < manifest_found.count; i++)
+		manifest_write_entry(fh, manifest_found.entries[i]);
+
+	if (fflush(fh) != 0 || fsync(fileno(fh)) != 0)
+		goto out;
+
+	if (fclose(fh) != 0)
+	{
+		fh = NULL;
+		goto out;
+	}
+	fh = NULL;
+
+	if (rename(tmppath, path) != 0)
+		goto out;
+
+	ret = 0;
+
+out:
+	errsv = errno;
+
+	if (fh)
+		(void) fclose(fh);
+	if (ret != 0)
+		(void) unlink(tmppath);
+
+	free(tmppath);
+	manifest_list_free(&manifest_found);
+	manifest_list_free(&manifest_cached);
+
+	errno = errsv;
+	return ret;
+}
+
+static int manifest_differs(const struct manifest_entry* const want, const struct manifest_entry* const have)
+{
+	if (want->type != have->type || want->mode != have->mode || want->uid != have->uid || want->gid != have->gid)
+		return 1;
+
+	if ((want->type == 'f' || want->type == 'l' || want->type == 'c' || want->type == 'b') && want->size != have->size)
+		return 1;
+
+	if (want->hashed != have->hashed || (want->hashed && memcmp(want->digest, have->digest, sizeof want->digest)))
+		return 1;
+
+	return 0;
+}
+
+static void manifest_report(size_t* const count, const char* const what, const char* const entry_path)
+{
+	if ((*count)++ < MANIFEST_REPORT_MAX)
+		(void) fprintf(stderr, "nschroot[parent]: manifest: %s: %s\n", entry_path, what);
+}
+
+/* Verify the directory root against the manifest at path. Returns -1 (with errno EBADMSG)
+ * if it doesn't match, listing the differences.
+ */
+int anschroot_manifest_verify(const char* const root, const char* const path, const int incremental)
+{
+	struct manifest_list want = { NULL, 0, 0 };
+	if (manifest_load(path, &want) != 0)
+		return -1;
+
+	// The manifest itself holds what's needed to know what's unchanged
+	manifest_incremental = incremental;
+	if (incremental)
+		manifest_cached = want;
+
+	int errsv = 0;
+	if (manifest_scan(root) != 0)
+	{
+		errsv = errno;
+		manifest_list_free(&manifest_found);
+		manifest_list_free(&want);
+		manifest_cached.entries = NULL;
+		manifest_cached.count = manifest_cached.alloc = 0;
+		errno = errsv;
+		return -1;
+	}
+
+	size_t differences = 0;
+	size_t i = 0;
+	size_t j = 0;
+
+	while (i < want.count || j < manifest_found.count)
+	{
+		const int cmp = (i == want.count) ? 1 : (j == manifest_found.count) ? -1 :
+		                strcmp(want.entries[i]->path, manifest_found.entries[j]->path);
+
+		if (cmp < 0)
+		{
+			manifest_report(&differences, "missing", want.entries[i++]->path);
+		}
+		else if (cmp > 0)
+		{
+			manifest_report(&differences, "not in the manifest", manifest_found.entries[j++]->path);
+		}
+		else
+		{
+			if (manifest_differs(want.entries[i], manifest_found.entries[j]))
+				manifest_report(&differences, "changed", want.entries[i]->path);
+
+			i++;
+			j++;
+		}
+	}
+
+	if (differences > MANIFEST_REPORT_MAX)
+		(void) fprintf(stderr, "nschroot[parent]: manifest: ... and %zu more differences\n", differences - MANIFEST_REPORT_MAX);
+
+	manifest_list_free(&manifest_found);
+	manifest_list_free(&want);
+	manifest_cached.entries = NULL;
+	manifest_cached.count = manifest_cached.alloc = 0;
+
+	if (differences)
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,454 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Session metrics.
+ *
+ * Every session adds to a set of counters and histograms kept in a file mapped into memory
+ * (METRICS_PATH), so that they aggregate over all anschroot invocations on the host. They
+ * are only ever updated with atomic additions; there are no locks anywhere on the launch
+ * path. The file is inherited by the child across fork(2), so that it can account for its
+ * own setup phases as well.
+ *
+ * The metrics can be rendered in the Prometheus text exposition format, to a file in a
+ * node_exporter textfile collector directory.
+ */
+#define METRICS_PATH            "/run/anschroot/metrics"
+#define METRICS_MAGIC           0x414E534D45545231ULL
+#define METRICS_FILE            "anschroot.prom"
+#define METRICS_ROOTS_MAX       128
+#define METRICS_ROOT_LEN        256
+#define METRICS_SIGNALS_MAX     65
+#define METRICS_PHASES_COUNT    (sizeof metrics_phases / sizeof metrics_phases[0])
+#define METRICS_BUCKETS_COUNT   (sizeof metrics_buckets / sizeof metrics_buckets[0])
+#define METRICS_CLASSES_COUNT   (sizeof metrics_classes / sizeof metrics_classes[0])
+
+// Setup phases (and also the stages at which a session can fail to start)
+static const char* const metrics_phases[] = {
+	"admission", "unshare", "image", "manifest", "clone", "scratch", "fork", "umount", "mount", "chroot", "caps", "exec", "total",
+};
+
+// Session classes (see ansclass.c)
+static const char* const metrics_classes[] = {
+	"interactive", "batch", "idle",
+};
+
+// Histogram bucket upper bounds, in microseconds
+static const uint64_t metrics_buckets[] = {
+	100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 30000000, 300000000,
+	3600000000ULL, 36000000000ULL,
+};
+
+struct metrics_histogram
+{
+	uint64_t        buckets[METRICS_BUCKETS_COUNT + 1];
+	uint64_t        sum;
+	uint64_t        count;
+};
+
+struct metrics_root
+{
+	uint64_t        hash;
+	uint64_t        ready;
+	uint64_t        sessions;
+	char            root[METRICS_ROOT_LEN];
+};
+
+struct metrics
+{
+	uint64_t                        magic;
+	uint64_t                        size;
+	int64_t                         running;
+	uint64_t                        exit_codes[256];
+	uint64_t                        exit_signals[METRICS_SIGNALS_MAX];
+	uint64_t                        failures[METRICS_PHASES_COUNT];
+	struct metrics_histogram        phases[METRICS_PHASES_COUNT];
+	struct metrics_histogram        cpu_usec;
+	struct metrics_histogram        wall_usec;
+	uint64_t                        maxrss_bytes_sum;
+	uint64_t                        maxrss_bytes_max;
+	uint64_t                        class_sessions[METRICS_CLASSES_COUNT];
+	uint64_t                        class_cpu_usec[METRICS_CLASSES_COUNT];
+	struct metrics_root             roots[METRICS_ROOTS_MAX];
+	uint64_t                        roots_other;
+};
+
+static struct metrics*  metrics = NULL;
+static uint64_t         metrics_session_start = 0;
+static int              metrics_session_class = -1;
+
+static uint64_t metrics_add(uint64_t* const counter, const uint64_t value)
+{
+	return __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_load(const uint64_t* const counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void metrics_observe(struct metrics_histogram* const hist, const uint64_t value)
+{
+	size_t i = 0;
+	while (i < METRICS_BUCKETS_COUNT && value > metrics_buckets[i])
+		i++;
+
+	(void) metrics_add(&hist->buckets[i], 1);
+	(void) metrics_add(&hist->sum, value);
+	(void) metrics_add(&hist->count, 1);
+}
+
+static int metrics_phase_index(const char* const phase)
+{
+	for (size_t i = 0; i < METRICS_PHASES_COUNT; i++)
+		if (! strcmp(metrics_phases[i], phase))
+			return (int) i;
+
+	return -1;
+}
+
+// A monotonic timestamp, in microseconds
+uint64_t anschroot_metrics_now(void)
+{
+	struct timespec ts;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000ULL) + ((uint64_t) ts.tv_nsec / 1000ULL);
+}
+
+int anschroot_metrics_open(void)
+{
+	metrics_session_start = anschroot_metrics_now();
+
+	void* map = MAP_FAILED;
+	int errsv = 0;
+
+	if (mkdir("/run/anschroot", 0755) != 0 && errno != EEXIST)
+		return -1;
+
+	int fd = -1;
+	if ((fd = open(METRICS_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		return -1;
+
+	/* The only lock; taken once per session, before the metrics are in use, to create (or
+	 * reset, if its layout has changed) the file.
+	 */
+	struct stat st;
+	if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0)
+		goto fail;
+
+	if ((size_t) st.st_size != sizeof(struct metrics))
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(struct metrics)) != 0)
+			goto fail;
+
+	if ((map = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto fail;
+
+	metrics = map;
+	if (metrics->magic != METRICS_MAGIC || metrics->size != sizeof(struct metrics))
+	{
+		memset(metrics, 0x00, sizeof(struct metrics));
+		metrics->size = sizeof(struct metrics);
+		metrics->magic = METRICS_MAGIC;
+	}
+
+	// The mapping keeps the file open (and so would keep it locked), so unlock it explicitly
+	(void) flock(fd, LOCK_UN);
+	(void) close(fd);
+	return 0;
+
+fail:
+	errsv = errno;
+	(void) close(fd);
+	errno = errsv;
+
+	return -1;
+}
+
+static uint64_t metrics_hash(const char* str)
+{
+	// FNV-1a (never 0, which marks a free slot)
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (; *str; str++)
+		hash = (hash ^ (unsigned char) *str) * 0x100000001B3ULL;
+
+	return hash ? hash : 1;
+}
+
+static uint64_t* metrics_root_sessions(const char* const root)
+{
+	const uint64_t hash = metrics_hash(root);
+
+	for (size_t i = 0; i < METRICS_ROOTS_MAX; i++)
+	{
+		struct metrics_root* const slot = &metrics->roots[(hash + i) % METRICS_ROOTS_MAX];
+
+		uint64_t expected = 0;
+		if (__atomic_compare_exchange_n(&slot->hash, &expected, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			// Claimed a free slot
+			(void) snprintf(slot->root, sizeof slot->root, "%s", root);
+			__atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+			return &slot->sessions;
+		}
+
+		// The same hash is (with overwhelming likelihood) the same root, even if not ready yet
+		if (expected == hash)
+			if (! __atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE) || ! strncmp(slot->root, root, sizeof slot->root - 1))
+				return &slot->sessions;
+	}
+
+	return &metrics->roots_other;
+}
+
+void anschroot_metrics_session_start(const char* const root, const char* const class)
+{
+	for (size_t i = 0; i < METRICS_CLASSES_COUNT; i++)
+		if (! strcmp(metrics_classes[i], class))
+			metrics_session_class = (int) i;
+
+	if (! metrics)
+		return;
+
+	(void) metrics_add(metrics_root_sessions(root), 1);
+	(void) __atomic_add_fetch(&metrics->running, 1, __ATOMIC_RELAXED);
+}
+
+// Account for the time taken by a setup phase that began at the given timestamp
+void anschroot_metrics_phase(const char* const phase, const uint64_t start)
+{
+	const int i = metrics_phase_index(phase);
+
+	if (metrics && i != -1)
+		metrics_observe(&metrics->phases[i], anschroot_metrics_now() - start);
+}
+
+// Account for the whole of the setup, since anschroot_metrics_open()
+void anschroot_metrics_setup_done(void)
+{
+	anschroot_metrics_phase("total", metrics_session_start);
+}
+
+void anschroot_metrics_failure(const char* const phase)
+{
+	const int i = metrics_phase_index(phase);
+
+	if (metrics && i != -1)
+		(void) metrics_add(&metrics->failures[i], 1);
+}
+
+void anschroot_metrics_session_end(const int status, const struct rusage* const ru)
+{
+	if (! metrics)
+		return;
+
+	(void) __atomic_sub_fetch(&metrics->running, 1, __ATOMIC_RELAXED);
+
+	if (WIFEXITED(status))
+		(void) metrics_add(&metrics->exit_codes[WEXITSTATUS(status)], 1);
+	else if (WIFSIGNALED(status) && WTERMSIG(status) < METRICS_SIGNALS_MAX)
+		(void) metrics_add(&metrics->exit_signals[WTERMSIG(status)], 1);
+
+	metrics_observe(&metrics->wall_usec, anschroot_metrics_now() - metrics_session_start);
+
+	if (metrics_session_class != -1)
+		(void) metrics_add(&metrics->class_sessions[metrics_session_class], 1);
+
+	if (! ru)
+		return;
+
+	const uint64_t cpu_usec = ((uint64_t) ru->ru_utime.tv_sec + (uint64_t) ru->ru_stime.tv_sec) * 1000000ULL +
+	                          (uint64_t) ru->ru_utime.tv_usec + (uint64_t) ru->ru_stime.tv_usec;
+
+	metrics_observe(&metrics->cpu_usec, cpu_usec);
+
+	if (metrics_session_class != -1)
+		(void) metrics_add(&metrics->class_cpu_usec[metrics_session_class], cpu_usec);
+
+	const uint64_t maxrss = (uint64_t) ru->ru_maxrss * 1024ULL;
+	(void) metrics_add(&metrics->maxrss_bytes_sum, maxrss);
+
+	uint64_t maxrss_max = metrics_load(&metrics->maxrss_bytes_max);
+	while (maxrss > maxrss_max)
+		if (__atomic_compare_exchange_n(&metrics->maxrss_bytes_max, &maxrss_max, maxrss, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+}
+
+static void metrics_print_label(FILE* const fh, const char* str)
+{
+	for (; *str; str++)
+	{
+		if (*str == '\\' || *str == '"')
+			(void) fprintf(fh, "\\%c", *str);
+		else if (*str == '\n')
+			(void) fputs("\\n", fh);
+		else
+			(void) fputc(*str, fh);
+	}
+}
+
+static void metrics_print_histogram(FILE* const fh, const char* const name, const char* const label,
+                                    const struct metrics_histogram* const hist)
+{
+	const char* const sep = *label ? "," : "";
+
+	uint64_t cumulative = 0;
+	for (size_t i = 0; i < METRICS_BUCKETS_COUNT; i++)
+	{
+		cumulative += metrics_load(&hist->buckets[i]);
+		(void) fprintf(fh, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, sep,
+		               (double) metrics_buckets[i] / 1000000.0, (unsigned long long) cumulative);
+	}
+	cumulative += metrics_load(&hist->buckets[METRICS_BUCKETS_COUNT]);
+
+	(void) fprintf(fh, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep, (unsigned long long) cumulative);
+	(void) fprintf(fh, "%s_sum{%s} %.6f\n", name, label, (double) metrics_load(&hist->sum) / 1000000.0);
+	(void) fprintf(fh, "%s_count{%s} %llu\n", name, label, (unsigned long long) metrics_load(&hist->count));
+}
+
+static void metrics_render(FILE* const fh)
+{
+	(void) fprintf(fh, "# HELP anschroot_sessions_running Sessions currently running.\n");
+	(void) fprintf(fh, "# TYPE anschroot_sessions_running gauge\n");
+	(void) fprintf(fh, "anschroot_sessions_running %lld\n",
+	               (long long) __atomic_load_n(&metrics->running, __ATOMIC_RELAXED));
+
+	(void) fprintf(fh, "# HELP anschroot_sessions_total Sessions started, by root.\n");
+	(void) fprintf(fh, "# TYPE anschroot_sessions_total counter\n");
+	for (size_t i = 0; i < METRICS_ROOTS_MAX; i++)
+	{
+		const struct metrics_root* const slot = &metrics->roots[i];
+		if (! __atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE))
+			continue;
+
+		(void) fprintf(fh, "anschroot_sessions_total{root=\"");
+		metrics_print_label(fh, slot->root);
+		(void) fprintf(fh, "\"} %llu\n", (unsigned long long) metrics_load(&slot->sessions));
+	}
+	if (metrics_load(&metrics->roots_other))
+		(void) fprintf(fh, "anschroot_sessions_total{root=\"other\"} %llu\n",
+		               (unsigned long long) metrics_load(&metrics->roots_other));
+
+	(void) fprintf(fh, "# HELP anschroot_exits_total Sessions ended, by exit status or terminating signal.\n");
+	(void) fprintf(fh, "# TYPE anschroot_exits_total counter\n");
+	for (size_t i = 0; i < 256; i++)
+		if (metrics_load(&metrics->exit_codes[i]))
+			(void) fprintf(fh, "anschroot_exits_total{status=\"%zu\"} %llu\n", i,
+			               (unsigned long long) metrics_load(&metrics->exit_codes[i]));
+	for (size_t i = 0; i < METRICS_SIGNALS_MAX; i++)
+		if (metrics_load(&metrics->exit_signals[i]))
+			(void) fprintf(fh, "anschroot_exits_total{signal=\"%zu\"} %llu\n", i,
+			               (unsigned long long) metrics_load(&metrics->exit_signals[i]));
+
+	(void) fprintf(fh, "# HELP anschroot_setup_failures_total Sessions that failed to start, by setup phase.\n");
+	(void) fprintf(fh, "# TYPE anschroot_setup_failures_total counter\n");
+	for (size_t i = 0; i < METRICS_PHASES_COUNT; i++)
+		(void) fprintf(fh, "anschroot_setup_failures_total{phase=\"%s\"} %llu\n", metrics_phases[i],
+		               (unsigned long long) metrics_load(&metrics->failures[i]));
+
+	(void) fprintf(fh, "# HELP anschroot_setup_phase_seconds Time taken by each setup phase.\n");
+	(void) fprintf(fh, "# TYPE anschroot_setup_phase_seconds histogram\n");
+	for (size_t i = 0; i < METRICS_PHASES_COUNT; i++)
+	{
+		char label[64];
+		(void) snprintf(label, sizeof label, "phase=\"%s\"", metrics_phases[i]);
+		metrics_print_histogram(fh, "anschroot_setup_phase_seconds", label, &metrics->phases[i]);
+	}
+
+	(void) fprintf(fh, "# HELP anschroot_session_seconds Wall-clock time taken by each session.\n");
+	(void) fprintf(fh, "# TYPE anschroot_session_seconds histogram\n");
+	metrics_print_histogram(fh, "anschroot_session_seconds", "", &metrics->wall_usec);
+
+	(void) fprintf(fh, "# HELP anschroot_session_cpu_seconds CPU time (user and system) used by each session.\n");
+	(void) fprintf(fh, "# TYPE anschroot_session_cpu_seconds histogram\n");
+	metrics_print_histogram(fh, "anschroot_session_cpu_seconds", "", &metrics->cpu_usec);
+
+	(void) fprintf(fh, "# HELP anschroot_class_sessions_total Sessions ended, by class.\n");
+	(void) fprintf(fh, "# TYPE anschroot_class_sessions_total counter\n");
+	for (size_t i = 0; i < METRICS_CLASSES_COUNT; i++)
+		(void) fprintf(fh, "anschroot_class_sessions_total{class=\"%s\"} %llu\n", metrics_classes[i],
+		               (unsigned long long) metrics_load(&metrics->class_sessions[i]));
+
+	(void) fprintf(fh, "# HELP anschroot_class_cpu_seconds_total CPU time (user and system) used by sessions, by class.\n");
+	(void) fprintf(fh, "# TYPE anschroot_class_cpu_seconds_total counter\n");
+	for (size_t i = 0; i < METRICS_CLASSES_COUNT; i++)
+		(void) fprintf(fh, "anschroot_class_cpu_seconds_total{class=\"%s\"} %.6f\n", metrics_classes[i],
+		               (double) metrics_load(&metrics->class_cpu_usec[i]) / 1000000.0);
+
+	(void) fprintf(fh, "# HELP anschroot_session_max_rss_bytes_sum Sum of the peak resident set sizes of sessions.\n");
+	(void) fprintf(fh, "# TYPE anschroot_session_max_rss_bytes_sum counter\n");
+	(void) fprintf(fh, "anschroot_session_max_rss_bytes_sum %llu\n",
+	               (unsigned long long) metrics_load(&metrics->maxrss_bytes_sum));
+
+	(void) fprintf(fh, "# HELP anschroot_session_max_rss_bytes_max Largest peak resident set size of any session.\n");
+	(void) fprintf(fh, "# TYPE anschroot_session_max_rss_bytes_max gauge\n");
+	(void) fprintf(fh, "anschroot_session_max_rss_bytes_max %llu\n",
+	               (unsigned long long) metrics_load(&metrics->maxrss_bytes_max));
+}
+
+/* Write the metrics to the textfile collector directory (atomically, with a rename, so that
+ * the collector never sees a partial file).
+ */
+int anschroot_metrics_write(const int dirfd)
+{
+	if (! metrics)
+		return 0;
+
+	char tmpname[NAME_MAX + 1];
+	(void) snprintf(tmpname, sizeof tmpname, ".%s.%ld", METRICS_FILE, (long) getpid());
+
+	int fd = -1;
+	if ((fd = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+		return -1;
+
+	FILE* fh = NULL;
+	if (! (fh = fdopen(fd, "w")))
+	{
+		(void) close(fd);
+		(void) unlinkat(dirfd, tmpname, 0);
+		return -1;
+	}
+
+	metrics_render(fh);
+
+	if (fclose(fh) != 0)
+	{
+		(void) unlinkat(dirfd, tmpname, 0);
+		return -1;
+	}
+
+	return renameat(dirfd, tmpname, dirfd, METRICS_FILE);
+}
@@ -0,0 +1,166 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Hardware performance counters for the whole session.
+ *
+ * The counters are opened on the child, by the parent, while the child waits to execute the
+ * workload. They're inherited by everything it goes on to run, and only start counting on
+ * execve(2) (so the setup isn't counted). Each is a separate event rather than one group,
+ * as the kernel can't read back groups of inherited counters; where the PMU has to multiplex
+ * them, the counts are scaled up by the share of the time each was actually running.
+ */
+#define PERF_COUNTERS_COUNT     (sizeof perf_counters / sizeof perf_counters[0])
+
+enum perf_counter
+{
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_PAGE_FAULTS,
+	PERF_CONTEXT_SWITCHES,
+	PERF_CPU_MIGRATIONS,
+};
+
+static const struct {
+	const char*     name;
+	uint32_t        type;
+	uint64_t        config;
+} perf_counters[] = {
+	[PERF_CYCLES]           = { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES       },
+	[PERF_INSTRUCTIONS]     = { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS     },
+	[PERF_CACHE_MISSES]     = { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES     },
+	[PERF_BRANCH_MISSES]    = { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES    },
+	[PERF_PAGE_FAULTS]      = { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS      },
+	[PERF_CONTEXT_SWITCHES] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[PERF_CPU_MIGRATIONS]   = { "cpu-migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS   },
+};
+
+static int perf_fds[PERF_COUNTERS_COUNT] = { -1, -1, -1, -1, -1, -1, -1 };
+
+/* Open the counters on pid (which must not have executed the workload yet). Returns the
+ * number of counters opened; those that this host doesn't have (e.g. hardware counters in
+ * most virtual machines) are left out.
+ */
+int anschroot_perf_open(const pid_t pid)
+{
+	int opened = 0;
+	int errsv = 0;
+
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; i++)
+	{
+		struct perf_event_attr attr;
+		(void) memset(&attr, 0x00, sizeof attr);
+
+		attr.size = sizeof attr;
+		attr.type = perf_counters[i].type;
+		attr.config = perf_counters[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.enable_on_exec = 1;
+		attr.exclude_hv = 1;
+
+		if ((perf_fds[i] = (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC)) == -1)
+			errsv = errno;
+		else
+			opened++;
+	}
+
+	if (! opened)
+		errno = errsv;
+
+	return opened;
+}
+
+// A counter's value, scaled for multiplexing; returns -1 if it wasn't counted
+static int perf_read(const enum perf_counter counter, double* const value)
+{
+	uint64_t data[3];
+
+	if (perf_fds[counter] == -1 || read(perf_fds[counter], data, sizeof data) != (ssize_t) sizeof data)
+		return -1;
+
+	if (! data[2])
+	{
+		*value = 0.0;
+		return data[1] ? -1 : 0;
+	}
+
+	*value = (double) data[0] * ((double) data[1] / (double) data[2]);
+	return 0;
+}
+
+/* Print a summary of the counters, next to how the session ended, and close them */
+void anschroot_perf_report(const int status)
+{
+	double values[PERF_COUNTERS_COUNT];
+	int counted[PERF_COUNTERS_COUNT];
+
+	if (WIFEXITED(status))
+		(void) fprintf(stderr, "nschroot[parent]: perf: session exited with status %d\n", WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		(void) fprintf(stderr, "nschroot[parent]: perf: session killed by signal %d\n", WTERMSIG(status));
+
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; i++)
+	{
+		counted[i] = (perf_read((enum perf_counter) i, &values[i]) == 0);
+
+		if (counted[i])
+			(void) fprintf(stderr, "nschroot[parent]: perf: %20.0f  %s\n", values[i], perf_counters[i].name);
+		else
+			(void) fprintf(stderr, "nschroot[parent]: perf: %20s  %s\n", "<not counted>", perf_counters[i].name);
+	}
+
+	if (counted[PERF_CYCLES] && counted[PERF_INSTRUCTIONS] && values[PERF_CYCLES] > 0.0)
+		(void) fprintf(stderr, "nschroot[parent]: perf: %20.2f  instructions per cycle\n",
+		               values[PERF_INSTRUCTIONS] / values[PERF_CYCLES]);
+
+	if (counted[PERF_INSTRUCTIONS] && values[PERF_INSTRUCTIONS] > 0.0)
+	{
+		if (counted[PERF_CACHE_MISSES])
+			(void) fprintf(stderr, "nschroot[parent]: perf: %20.2f  cache misses per 1000 instructions\n",
+			               values[PERF_CACHE_MISSES] * 1000.0 / values[PERF_INSTRUCTIONS]);
+
+		if (counted[PERF_BRANCH_MISSES])
+			(void) fprintf(stderr, "nschroot[parent]: perf: %20.2f  branch misses per 1000 instructions\n",
+			               values[PERF_BRANCH_MISSES] * 1000.0 / values[PERF_INSTRUCTIONS]);
+	}
+
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; i++)
+	{
+		if (perf_fds[i] != -1)
+			(void) close(perf_fds[i]);
+
+		perf_fds[i] = -1;
+	}
+}
@@ -0,0 +1,519 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Page-cache prewarming.
+ *
+ * A profile is a text file of "<offset> <length> <path>" lines, with paths relative to the
+ * root. It is recorded by watching which files the session opens (with fanotify), and then
+ * checking which parts of them are resident in the page cache (with mincore) at the end of
+ * the session. On later entries, the listed ranges are read ahead from a small pool of
+ * threads while the rest of the session setup proceeds.
+ */
+
+#define PREWARM_THREADS_MAX     8
+
+struct prof_range
+{
+	unsigned long long      offset;
+	unsigned long long      length;
+	char*                   path;
+};
+
+static struct prof_range*       prewarm_ranges = NULL;
+static size_t                   prewarm_ranges_count = 0;
+static size_t                   prewarm_ranges_next = 0;
+static pthread_t                prewarm_threads[PREWARM_THREADS_MAX];
+static unsigned int             prewarm_threads_count = 0;
+static int                      prewarm_rootfd = -1;
+
+/* The set of paths opened during the session (an open-addressing hash table, as the same
+ * files are opened over and over during a build).
+ */
+static char**                   record_paths = NULL;
+static size_t                   record_paths_size = 0;
+static size_t                   record_paths_count = 0;
+static pthread_t                record_thread;
+static int                      record_thread_started = 0;
+static int                      record_stopfds[2] = { -1, -1 };
+static int                      record_setupfd = -1;
+static int                      record_gofd = -1;
+static int                      record_procfd = -1;
+static char                     record_root[PATH_MAX];
+
+static void* prewarm_worker(void* const arg)
+{
+	(void) arg;
+
+	for (;;)
+	{
+		const size_t i = __atomic_fetch_add(&prewarm_ranges_next, 1, __ATOMIC_RELAXED);
+		if (i >= prewarm_ranges_count)
+			break;
+
+		const struct prof_range* const r = &prewarm_ranges[i];
+
+		int fd = -1;
+		if ((fd = openat(prewarm_rootfd, r->path, O_RDONLY | O_NOATIME | O_NOFOLLOW | O_CLOEXEC)) == -1)
+			continue;
+
+		if (readahead(fd, (off64_t) r->offset, (size_t) r->length) != 0)
+			(void) posix_fadvise(fd, (off_t) r->offset, (off_t) r->length, POSIX_FADV_WILLNEED);
+
+		(void) close(fd);
+	}
+
+	return NULL;
+}
+
+int anschroot_profile_prewarm_load(const char* const profile_path)
+{
+	FILE* fh = NULL;
+	if (! (fh = fopen(profile_path, "re")))
+		return (errno == ENOENT) ? 0 : -1;
+
+	char* line = NULL;
+	size_t len = 0;
+	size_t alloc = 0;
+	while (getline(&line, &len, fh) != -1)
+	{
+		unsigned long long offset = 0;
+		unsigned long long length = 0;
+		int pathpos = 0;
+
+		if (sscanf(line, "%llu %llu %n", &offset, &length, &pathpos) < 2 || ! pathpos)
+			continue;
+
+		char* path = line + pathpos;
+		path[strcspn(path, "\n")] = '\0';
+
+		// Paths are relative to the root; strip any leading slashes so openat(2) keeps them there
+		while (*path == '/')
+			path++;
+
+		if (! *path)
+			continue;
+
+		if (prewarm_ranges_count == alloc)
+		{
+			const size_t alloc_new = alloc ? (alloc * 2) : 1024;
+			struct prof_range* ranges_new = realloc(prewarm_ranges, alloc_new * sizeof(*ranges_new));
+			if (! ranges_new)
+				break;
+
+			prewarm_ranges = ranges_new;
+			alloc = alloc_new;
+		}
+
+		if (! (prewarm_ranges[prewarm_ranges_count].path = strdup(path)))
+			break;
+
+		prewarm_ranges[prewarm_ranges_count].offset = offset;
+		prewarm_ranges[prewarm_ranges_count].length = length;
+		prewarm_ranges_count++;
+	}
+	(void) fclose(fh);
+	free(line);
+
+	return 0;
+}
+
+/* Start reading ahead the ranges loaded by anschroot_profile_prewarm_load() in the background */
+int anschroot_profile_prewarm_start(const char* const vm_root_path)
+{
+	if (! prewarm_ranges_count)
+		return 0;
+
+	if ((prewarm_rootfd = open(vm_root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 2)
+		ncpus = 2;
+	if (ncpus > PREWARM_THREADS_MAX)
+		ncpus = PREWARM_THREADS_MAX;
+
+	for (long i = 0; i < ncpus; i++)
+		if (pthread_create(&prewarm_threads[prewarm_threads_count], NULL, prewarm_worker, NULL) == 0)
+			prewarm_threads_count++;
+
+	return 0;
+}
+
+void anschroot_profile_prewarm_finish(void)
+{
+	for (unsigned int i = 0; i < prewarm_threads_count; i++)
+		(void) pthread_join(prewarm_threads[i], NULL);
+
+	for (size_t i = 0; i < prewarm_ranges_count; i++)
+		free(prewarm_ranges[i].path);
+
+	free(prewarm_ranges);
+	prewarm_ranges = NULL;
+	prewarm_ranges_count = 0;
+	prewarm_threads_count = 0;
+
+	if (prewarm_rootfd != -1)
+		(void) close(prewarm_rootfd);
+
+	prewarm_rootfd = -1;
+}
+
+static size_t record_hash(const char* str)
+{
+	// FNV-1a
+	size_t hash = 0xCBF29CE484222325ULL;
+	for (; *str; str++)
+		hash = (hash ^ (unsigned char) *str) * 0x100000001B3ULL;
+
+	return hash;
+}
+
+static void record_add(const char* const path)
+{
+	if ((record_paths_count + 1) * 2 > record_paths_size)
+	{
+		const size_t size_new = record_paths_size ? (record_paths_size * 2) : 4096;
+		char** paths_new = calloc(size_new, sizeof(*paths_new));
+		if (! paths_new)
+			return;
+
+		for (size_t i = 0; i < record_paths_size; i++)
+		{
+			if (! record_paths[i])
+				continue;
+
+			size_t j = record_hash(record_paths[i]) & (size_new - 1);
+			while (paths_new[j])
+				j = (j + 1) & (size_new - 1);
+
+			paths_new[j] = record_paths[i];
+		}
+
+		free(record_paths);
+		record_paths = paths_new;
+		record_paths_size = size_new;
+	}
+
+	size_t i = record_hash(path) & (record_paths_size - 1);
+	while (record_paths[i])
+	{
+		if (strcmp(record_paths[i], path) == 0)
+			return;
+
+		i = (i + 1) & (record_paths_size - 1);
+	}
+
+	if ((record_paths[i] = strdup(path)))
+		record_paths_count++;
+}
+
+/* Mark every mount that makes up the root; i.e. the one the root is on, and all of those
+ * below it, except for the pseudo-filesystems mounted by anschroot_mount_paths_inroot().
+ */
+static int record_mark_mounts(const int fanfd)
+{
+	const uint64_t mask = FAN_OPEN | FAN_OPEN_EXEC;
+
+	if (fanotify_mark(fanfd, FAN_MARK_ADD | FAN_MARK_MOUNT, mask, AT_FDCWD, record_root) != 0)
+		return -1;
+
+	int fd = -1;
+	if ((fd = openat(record_procfd, "mounts", O_RDONLY | O_CLOEXEC)) == -1)
+		return 0;
+
+	FILE* fh = NULL;
+	if (! (fh = fdopen(fd, "r")))
+	{
+		(void) close(fd);
+		return 0;
+	}
+
+	const size_t root_len = strlen(record_root);
+
+	char* line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, fh) != -1)
+	{
+		char mountpoint[PATH_MAX];
+		char fstype[64];
+		if (sscanf(line, "%*s %4095s %63s", mountpoint, fstype) < 2)
+			continue;
+
+		if (strncmp(mountpoint, record_root, root_len) != 0 || mountpoint[root_len] != '/')
+			continue;
+
+		if (! strcmp(fstype, "proc") || ! strcmp(fstype, "devpts") || ! strcmp(fstype, "tmpfs"))
+			continue;
+
+		(void) fanotify_mark(fanfd, FAN_MARK_ADD | FAN_MARK_MOUNT, mask, AT_FDCWD, mountpoint);
+	}
+	(void) fclose(fh);
+	free(line);
+
+	return 0;
+}
+
+static void* record_worker(void* const arg)
+{
+	(void) arg;
+
+	/* Wait for the child to finish mounting everything in the root (EOF means it has gone
+	 * away instead)
+	 */
+	ssize_t ret = 0;
+	char dummy;
+	while ((ret = read(record_setupfd, &dummy, sizeof dummy)) == -1 && errno == EINTR)
+		continue;
+
+	(void) close(record_setupfd);
+
+	int fanfd = -1;
+	if ((fanfd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_NOATIME)) == -1)
+		(void) fprintf(stderr, "nschroot[parent]: fanotify_init(2): %s\n", strerror(errno));
+	else if (record_mark_mounts(fanfd) != 0)
+	{
+		(void) fprintf(stderr, "nschroot[parent]: fanotify_mark(2): %s\n", strerror(errno));
+		(void) close(fanfd);
+		fanfd = -1;
+	}
+
+	// Only now let it execute anything, so that the executable and its libraries are seen too
+	if (ret == 1 && write(record_gofd, "", 1) != 1)
+		(void) fprintf(stderr, "nschroot[parent]: write(2): %s\n", strerror(errno));
+
+	(void) close(record_gofd);
+
+	if (fanfd == -1)
+		return NULL;
+
+	const size_t root_len = strlen(record_root);
+
+	struct pollfd pfds[2] = {
+		{ .fd = fanfd, .events = POLLIN },
+		{ .fd = record_stopfds[0], .events = POLLIN },
+	};
+
+	for (;;)
+	{
+		if (poll(pfds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		// Drain the queue before honouring the stop request
+		if (! (pfds[0].revents & POLLIN))
+		{
+			if (pfds[1].revents)
+				break;
+
+			continue;
+		}
+
+		char buf[8192] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+		const ssize_t buflen = read(fanfd, buf, sizeof buf);
+		if (buflen <= 0)
+			continue;
+
+		const struct fanotify_event_metadata* ev = (const struct fanotify_event_metadata*) buf;
+		for (ssize_t evlen = buflen; FAN_EVENT_OK(ev, evlen); ev = FAN_EVENT_NEXT(ev, evlen))
+		{
+			if (ev->fd < 0)
+				continue;
+
+			char fdpath[64];
+			char path[PATH_MAX];
+			(void) snprintf(fdpath, sizeof fdpath, "fd/%d", ev->fd);
+
+			const ssize_t pathlen = readlinkat(record_procfd, fdpath, path, sizeof path - 1);
+			if (pathlen > 0)
+			{
+				path[pathlen] = '\0';
+
+				if ((size_t) pathlen > root_len && ! memcmp(path, record_root, root_len) && path[root_len] == '/')
+					record_add(path + root_len);
+			}
+
+			(void) close(ev->fd);
+		}
+	}
+
+	(void) close(fanfd);
+	return NULL;
+}
+
+/* Get hold of our /proc/self before the child unmounts /proc (it's shared with us) */
+int anschroot_profile_record_init(void)
+{
+	if ((record_procfd = open("/proc/self", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+
+	return 0;
+}
+
+/* Start recording which files are opened in the root, once the child says (on setupfd) that
+ * it has finished setting up; it is then given the go-ahead (on gofd) to execute anything.
+ */
+int anschroot_profile_record_start(const char* const vm_root_path, const int setupfd, const int gofd)
+{
+	(void) snprintf(record_root, sizeof record_root, "%s", vm_root_path);
+
+	if (pipe2(record_stopfds, O_CLOEXEC) != 0)
+		return -1;
+
+	record_setupfd = setupfd;
+	record_gofd = gofd;
+
+	if ((errno = pthread_create(&record_thread, NULL, record_worker, NULL)) != 0)
+		return -1;
+
+	record_thread_started = 1;
+	return 0;
+}
+
+static void record_write_ranges(FILE* const fh, const int rootfd, const char* const path)
+{
+	int fd = -1;
+	if ((fd = openat(rootfd, path + 1, O_RDONLY | O_NOATIME | O_NOFOLLOW | O_CLOEXEC)) == -1)
+		return;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || ! S_ISREG(st.st_mode) || ! st.st_size)
+	{
+		(void) close(fd);
+		return;
+	}
+
+	const size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	const size_t npages = ((size_t) st.st_size + pagesize - 1) / pagesize;
+
+	void* map = MAP_FAILED;
+	unsigned char* vec = NULL;
+
+	if ((map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+	    ! (vec = malloc(npages)) || mincore(map, (size_t) st.st_size, vec) != 0)
+	{
+		// Can't tell which parts are cached; just prewarm the whole file next time
+		(void) fprintf(fh, "0 %llu %s\n", (unsigned long long) st.st_size, path);
+	}
+	else
+	{
+		// Coalesce runs of resident pages into ranges
+		for (size_t i = 0; i < npages; )
+		{
+			if (! (vec[i] & 1))
+			{
+				i++;
+				continue;
+			}
+
+			size_t j = i;
+			while (j < npages && (vec[j] & 1))
+				j++;
+
+			(void) fprintf(fh, "%llu %llu %s\n", (unsigned long long) (i * pagesize),
+			               (unsigned long long) ((j - i) * pagesize), path);
+			i = j;
+		}
+	}
+
+	free(vec);
+	if (map != MAP_FAILED)
+		(void) munmap(map, (size_t) st.st_size);
+
+	(void) close(fd);
+}
+
+/* Stop recording and (re)write the profile to profile_name in the directory profile_dirfd */
+int anschroot_profile_record_finish(const int profile_dirfd, const char* const profile_name)
+{
+	if (! record_thread_started)
+		return -1;
+
+	(void) close(record_stopfds[1]);
+	(void) pthread_join(record_thread, NULL);
+	(void) close(record_stopfds[0]);
+	(void) close(record_procfd);
+	record_thread_started = 0;
+
+	char tmpname[NAME_MAX + 1];
+	(void) snprintf(tmpname, sizeof tmpname, ".%s.%ld", profile_name, (long) getpid());
+
+	int rootfd = -1;
+	if ((rootfd = open(record_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+
+	int fd = -1;
+	if ((fd = openat(profile_dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+	{
+		(void) close(rootfd);
+		return -1;
+	}
+
+	FILE* fh = NULL;
+	if (! (fh = fdopen(fd, "w")))
+	{
+		(void) close(fd);
+		(void) close(rootfd);
+		return -1;
+	}
+
+	for (size_t i = 0; i < record_paths_size; i++)
+	{
+		if (! record_paths[i])
+			continue;
+
+		record_write_ranges(fh, rootfd, record_paths[i]);
+		free(record_paths[i]);
+	}
+	free(record_paths);
+	record_paths = NULL;
+	record_paths_size = 0;
+	record_paths_count = 0;
+
+	(void) close(rootfd);
+
+	if (fclose(fh) != 0)
+	{
+		(void) unlinkat(profile_dirfd, tmpname, 0);
+		return -1;
+	}
+
+	return renameat(profile_dirfd, tmpname, profile_dirfd, profile_name);
+}
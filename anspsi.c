@@ -0,0 +1,255 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Admission control.
+ *
+ * Before a session is started, the host's pressure stall information (PSI) is checked; if
+ * tasks have recently spent too much of their time waiting for CPU, memory or IO (the 10
+ * second average of "some" stall), the launch is held back until that pressure clears, so
+ * that a new build doesn't push every other one into reclaim or IO thrashing.
+ *
+ * While waiting, a PSI trigger is registered for each resource with the same threshold over
+ * a PSI_WINDOW; the kernel wakes us (POLLPRI) whenever the stall within a window exceeds it.
+ * The pressure is considered to have cleared once PSI_QUIET_WINDOWS windows in a row go by
+ * without any of them firing.
+ *
+ * Launches make their admission decisions one at a time, in turn on a lock (ADMISSION_LOCK)
+ * that is held only until the decision has been made; otherwise, everything waiting on the
+ * same pressure would see the same quiet windows, and all start at once, recreating it. The
+ * lock is not held while the session is set up (an image mounted, a manifest verified, a root
+ * cloned), which can take much longer than the decision, and has nothing to do with it. It is
+ * a POSIX record lock, so that it is never inherited by anything we fork.
+ */
+#define ADMISSION_LOCK          "/run/anschroot/admission"
+#define ADMISSION_LOCK_RETRY    100000000L
+
+#define PSI_WINDOW              1000000
+#define PSI_QUIET_WINDOWS       2
+#define PSI_RESOURCES_COUNT     (sizeof psi_resources / sizeof psi_resources[0])
+
+static const struct psi_resource {
+	const char*     name;
+	const char*     path;
+	unsigned int    threshold;      // Percent of PSI_WINDOW
+} psi_resources[] = {
+	{ "cpu",        "/proc/pressure/cpu",           80 },
+	{ "memory",     "/proc/pressure/memory",        10 },
+	{ "io",         "/proc/pressure/io",            30 },
+};
+
+static int admission_lockfd = -1;
+
+/* Take our turn; returns 0 once we have it, or -1 if it didn't come before the deadline (an
+ * unusable lock file just means launches aren't queued).
+ */
+static int admission_lock(const struct timespec* const start, const unsigned int timeout)
+{
+	if ((mkdir("/run/anschroot", 0755) != 0 && errno != EEXIST) ||
+	    (admission_lockfd = open(ADMISSION_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		return 0;
+
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+
+	while (fcntl(admission_lockfd, F_SETLK, &lock) != 0)
+	{
+		if (errno != EACCES && errno != EAGAIN)
+			return 0;
+
+		struct timespec now;
+		(void) clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((unsigned int) (now.tv_sec - start->tv_sec) >= timeout)
+			return -1;
+
+		const struct timespec retry = { .tv_sec = 0, .tv_nsec = ADMISSION_LOCK_RETRY };
+		(void) nanosleep(&retry, NULL);
+	}
+
+	return 0;
+}
+
+// Let the next launch make its decision
+static void admission_release(void)
+{
+	if (admission_lockfd != -1)
+		(void) close(admission_lockfd);
+
+	admission_lockfd = -1;
+}
+
+// The "some avg10" figure from a pressure file, or a negative value if there isn't one
+static double psi_avg10(const int fd)
+{
+	char buf[256];
+	const ssize_t len = pread(fd, buf, sizeof buf - 1, 0);
+	if (len <= 0)
+		return -1.0;
+
+	buf[len] = '\0';
+
+	double avg10 = -1.0;
+	if (sscanf(buf, "some avg10=%lf", &avg10) != 1)
+		return -1.0;
+
+	return avg10;
+}
+
+// Which resource (if any) is over its threshold right now
+static int psi_pressured(const int* const fds, double* const avg10)
+{
+	for (size_t i = 0; i < PSI_RESOURCES_COUNT; i++)
+	{
+		if (fds[i] == -1)
+			continue;
+
+		if ((*avg10 = psi_avg10(fds[i])) >= (double) psi_resources[i].threshold)
+			return (int) i;
+	}
+
+	return -1;
+}
+
+/* Wait (for up to timeout seconds) until launching another session won't overcommit the
+ * host. If it still would by then, returns -1, with the reason written to reason.
+ */
+int anschroot_admission_wait(const unsigned int timeout, char* const reason, const size_t reason_len)
+{
+	int fds[PSI_RESOURCES_COUNT];
+	struct pollfd pfds[PSI_RESOURCES_COUNT];
+	size_t npfds = 0;
+
+	struct timespec start;
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (admission_lock(&start, timeout) != 0)
+	{
+		(void) snprintf(reason, reason_len, "other launches were still being admitted after %us", timeout);
+		admission_release();
+		return -1;
+	}
+
+	for (size_t i = 0; i < PSI_RESOURCES_COUNT; i++)
+		fds[i] = open(psi_resources[i].path, O_RDONLY | O_CLOEXEC);
+
+	// The fast (and usual) path; no pressure, or no PSI (which is as good as no pressure)
+	double avg10 = 0.0;
+	int resource = psi_pressured(fds, &avg10);
+
+	if (resource == -1)
+		goto out;
+
+	(void) fprintf(stderr, "nschroot[parent]: admission: waiting for %s pressure to clear (%.2f%% stalled)\n",
+		               psi_resources[resource].name, avg10);
+
+	// Triggers need a file of their own, opened for writing
+	for (size_t i = 0; i < PSI_RESOURCES_COUNT; i++)
+	{
+		if (fds[i] == -1)
+			continue;
+
+		int fd = -1;
+		if ((fd = open(psi_resources[i].path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1)
+			continue;
+
+		char trigger[64];
+		(void) snprintf(trigger, sizeof trigger, "some %u %u", (PSI_WINDOW / 100) * psi_resources[i].threshold, PSI_WINDOW);
+
+		if (write(fd, trigger, strlen(trigger) + 1) < 0)
+		{
+			(void) close(fd);
+			continue;
+		}
+
+		pfds[npfds].fd = fd;
+		pfds[npfds].events = POLLPRI;
+		npfds++;
+	}
+
+	unsigned int quiet = 0;
+	for (;;)
+	{
+		struct timespec now;
+		(void) clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((unsigned int) (now.tv_sec - start.tv_sec) >= timeout)
+			break;
+
+		const int ret = poll(pfds, npfds, PSI_WINDOW / 1000);
+		if (ret == -1 && errno != EINTR)
+			break;
+
+		if (ret > 0)
+		{
+			quiet = 0;
+
+			// A trigger that has gone bad is dropped (rather than left to poll as forever quiet)
+			for (size_t i = 0; i < npfds; )
+			{
+				if (pfds[i].revents & (POLLERR | POLLNVAL))
+				{
+					(void) close(pfds[i].fd);
+					pfds[i] = pfds[--npfds];
+				}
+				else
+					i++;
+			}
+
+			continue;
+		}
+
+		// Without any (remaining) triggers, fall back to watching the averages
+		if (ret == 0 && (npfds ? (++quiet >= PSI_QUIET_WINDOWS) : (psi_pressured(fds, &avg10) == -1)))
+		{
+			resource = -1;
+			break;
+		}
+	}
+
+	// Timed out (still under pressure): see where things are now
+	if (resource != -1)
+		resource = psi_pressured(fds, &avg10);
+
+	for (size_t i = 0; i < npfds; i++)
+		(void) close(pfds[i].fd);
+
+out:
+	for (size_t i = 0; i < PSI_RESOURCES_COUNT; i++)
+		if (fds[i] != -1)
+			(void) close(fds[i]);
+
+	admission_release();
+
+	if (resource == -1)
+		return 0;
+
+	(void) snprintf(reason, reason_len, "%s pressure (%.2f%% stalled) persisted for %us",
+	                psi_resources[resource].name, avg10, timeout);
+
+	return -1;
+}
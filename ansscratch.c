@@ -0,0 +1,356 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/loop.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern int          anschroot_loop_attach(const int backingfd, const uint32_t lo_flags, char* const loopdev, const size_t loopdev_len);
+extern unsigned int anschroot_session_count(void);
+
+/* The Portage build directory (scratch space).
+ *
+ * Which backend is used is decided at session start, from the memory available, the number
+ * of sessions sharing it, and the size the build is expected to need (the hint):
+ *
+ *   - tmpfs, if this session's share of available memory covers the hint; the tmpfs is then
+ *     grown online (with a remount) if it starts running out of space, for as long as
+ *     memory allows
+ *   - a zram device, if a compressed copy of the hint would fit instead
+ *   - otherwise a sparse, unlinked file on disk, attached to a loop device
+ *
+ * The latter two are formatted with ext4 (without a journal; this is throwaway data).
+ */
+#define SCRATCH_TARGET          "/var/tmp/portage"
+#define SCRATCH_UID             250
+#define SCRATCH_GID             250
+#define SCRATCH_HINT_DEFAULT    (2ULL << 30)
+#define SCRATCH_DISK_MIN        (16ULL << 30)
+#define SCRATCH_ZRAM_RATIO      3
+#define SCRATCH_INODE_RATIO     8192ULL
+#define SCRATCH_GROW_PERCENT    80
+#define SCRATCH_GROW_INTERVAL   2000
+
+enum scratch_backend
+{
+	SCRATCH_TMPFS,
+	SCRATCH_ZRAM,
+	SCRATCH_DISK,
+};
+
+static enum scratch_backend     scratch_backend = SCRATCH_TMPFS;
+static char                     scratch_target[PATH_MAX];
+static unsigned long long       scratch_size = 0;
+static int                      scratch_zram = -1;
+static pthread_t                scratch_thread;
+static int                      scratch_thread_started = 0;
+static int                      scratch_stopfds[2] = { -1, -1 };
+static int                      scratch_meminfo_fd = -1;
+
+/* /proc/meminfo is opened once, up front; the child unmounts /proc from the mount namespace
+ * that we share with it, and the tmpfs monitor still needs to read it after that.
+ */
+static unsigned long long scratch_mem_available(void)
+{
+	if (scratch_meminfo_fd == -1)
+		return 0;
+
+	char buf[4096];
+	const ssize_t len = pread(scratch_meminfo_fd, buf, sizeof buf - 1, 0);
+	if (len <= 0)
+		return 0;
+
+	buf[len] = '\0';
+
+	unsigned long long kbytes = 0;
+	const char* const line = strstr(buf, "MemAvailable:");
+	if (! line || sscanf(line, "MemAvailable: %llu kB", &kbytes) != 1)
+		return 0;
+
+	return kbytes * 1024ULL;
+}
+
+static int scratch_write_file(const char* const path, const char* const value)
+{
+	int fd = -1;
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	const size_t len = strlen(value);
+	const ssize_t ret = write(fd, value, len);
+	const int errsv = errno;
+	(void) close(fd);
+	errno = errsv;
+
+	return (ret == (ssize_t) len) ? 0 : -1;
+}
+
+static int scratch_mkfs(const char* const device)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0)
+	{
+		const int nullfd = open("/dev/null", O_WRONLY);
+		if (nullfd != -1)
+			(void) dup2(nullfd, STDOUT_FILENO);
+
+		(void) execlp("mkfs.ext4", "mkfs.ext4", "-q", "-F", "-m", "0", "-O", "^has_journal",
+		              "-E", "lazy_itable_init=1,nodiscard", device, (char*) NULL);
+		_exit(127);
+	}
+
+	int status = 0;
+	if (waitpid(pid, &status, 0) == -1)
+		return -1;
+
+	if (! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int scratch_mount_blockdev(const char* const device)
+{
+	if (scratch_mkfs(device) != 0)
+		return -1;
+
+	if (mount(device, scratch_target, "ext4", MS_NOSUID | MS_NOATIME, "discard") != 0)
+		return -1;
+
+	if (chown(scratch_target, SCRATCH_UID, SCRATCH_GID) != 0 || chmod(scratch_target, 0755) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int scratch_mount_tmpfs(void)
+{
+	char fsopts[128];
+	(void) snprintf(fsopts, sizeof fsopts, "size=%llu,nr_inodes=%llu,mode=0755,uid=%d,gid=%d",
+	                scratch_size, scratch_size / SCRATCH_INODE_RATIO, SCRATCH_UID, SCRATCH_GID);
+
+	return mount("tmpfs", scratch_target, "tmpfs", MS_NOSUID, fsopts);
+}
+
+static int scratch_mount_zram(void)
+{
+	char value[64];
+	char path[PATH_MAX];
+
+	int fd = -1;
+	if ((fd = open("/sys/class/zram-control/hot_add", O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	const ssize_t len = read(fd, value, sizeof value - 1);
+	(void) close(fd);
+	if (len <= 0)
+		return -1;
+
+	value[len] = '\0';
+	scratch_zram = atoi(value);
+
+	(void) snprintf(path, sizeof path, "/sys/block/zram%d/disksize", scratch_zram);
+	(void) snprintf(value, sizeof value, "%llu", scratch_size);
+	if (scratch_write_file(path, value) != 0)
+		return -1;
+
+	(void) snprintf(path, sizeof path, "/dev/zram%d", scratch_zram);
+	return scratch_mount_blockdev(path);
+}
+
+static int scratch_mount_disk(const char* const scratch_dir)
+{
+	if (mkdir(scratch_dir, 0700) != 0 && errno != EEXIST)
+		return -1;
+
+	// An anonymous file; it goes away by itself once the loop device lets go of it
+	int fd = -1;
+	if ((fd = open(scratch_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) == -1)
+		return -1;
+
+	char loopdev[PATH_MAX];
+	int loopfd = -1;
+	if (ftruncate(fd, (off_t) scratch_size) != 0 || (loopfd = anschroot_loop_attach(fd, 0, loopdev, sizeof loopdev)) == -1)
+	{
+		const int errsv = errno;
+		(void) close(fd);
+		errno = errsv;
+		return -1;
+	}
+	(void) close(fd);
+
+	const int ret = scratch_mount_blockdev(loopdev);
+	const int errsv = errno;
+	(void) close(loopfd);
+	errno = errsv;
+
+	return ret;
+}
+
+static void scratch_grow(void)
+{
+	struct statvfs sv;
+	if (statvfs(scratch_target, &sv) != 0 || ! sv.f_blocks)
+		return;
+
+	const unsigned long long used = (unsigned long long) (sv.f_blocks - sv.f_bfree) * sv.f_frsize;
+	if (used * 100 < scratch_size * SCRATCH_GROW_PERCENT)
+		return;
+
+	// Grow by half again, but no further than our share of the memory still available
+	const unsigned long long share = scratch_mem_available() / anschroot_session_count();
+	unsigned long long size_new = scratch_size + (scratch_size / 2);
+	if (size_new > scratch_size + share)
+		size_new = scratch_size + share;
+
+	if (size_new <= scratch_size)
+		return;
+
+	char fsopts[128];
+	(void) snprintf(fsopts, sizeof fsopts, "size=%llu,nr_inodes=%llu", size_new, size_new / SCRATCH_INODE_RATIO);
+
+	if (mount(NULL, scratch_target, NULL, MS_REMOUNT | MS_NOSUID, fsopts) == 0)
+		scratch_size = size_new;
+}
+
+static void* scratch_worker(void* const arg)
+{
+	(void) arg;
+
+	struct pollfd pfd = { .fd = scratch_stopfds[0], .events = POLLIN };
+
+	for (;;)
+	{
+		const int ret = poll(&pfd, 1, SCRATCH_GROW_INTERVAL);
+
+		if (ret > 0 || (ret == -1 && errno != EINTR))
+			break;
+
+		if (ret == 0)
+			scratch_grow();
+	}
+
+	return NULL;
+}
+
+/* Watch the usage of a tmpfs scratch space in the background, growing it when needed */
+int anschroot_scratch_monitor_start(void)
+{
+	if (scratch_backend != SCRATCH_TMPFS)
+		return 0;
+
+	if (pipe2(scratch_stopfds, O_CLOEXEC) != 0)
+		return -1;
+
+	if ((errno = pthread_create(&scratch_thread, NULL, scratch_worker, NULL)) != 0)
+		return -1;
+
+	scratch_thread_started = 1;
+	return 0;
+}
+
+void anschroot_scratch_monitor_stop(void)
+{
+	if (scratch_thread_started)
+	{
+		(void) close(scratch_stopfds[1]);
+		(void) pthread_join(scratch_thread, NULL);
+		(void) close(scratch_stopfds[0]);
+		scratch_thread_started = 0;
+	}
+}
+
+void anschroot_scratch_release(void)
+{
+	anschroot_scratch_monitor_stop();
+
+	// The tmpfs and loop backends are released along with the mount namespace, but zram isn't
+	if (scratch_zram != -1)
+	{
+		char value[32];
+		(void) snprintf(value, sizeof value, "%d", scratch_zram);
+
+		(void) umount2(scratch_target, MNT_DETACH);
+		(void) scratch_write_file("/sys/class/zram-control/hot_remove", value);
+		scratch_zram = -1;
+	}
+
+	if (scratch_meminfo_fd != -1)
+		(void) close(scratch_meminfo_fd);
+
+	scratch_meminfo_fd = -1;
+}
+
+int anschroot_scratch_setup(const char* const vm_root_path, const unsigned long long hint, const char* const scratch_dir)
+{
+	(void) snprintf(scratch_target, sizeof scratch_target, "%s%s", vm_root_path, SCRATCH_TARGET);
+
+	if ((scratch_meminfo_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	const unsigned long long need = hint ? hint : SCRATCH_HINT_DEFAULT;
+	const unsigned long long share = scratch_mem_available() / anschroot_session_count();
+
+	if (share >= need)
+	{
+		scratch_backend = SCRATCH_TMPFS;
+		scratch_size = need;
+
+		return scratch_mount_tmpfs();
+	}
+
+	if (share >= need / SCRATCH_ZRAM_RATIO && access("/sys/class/zram-control/hot_add", R_OK) == 0)
+	{
+		scratch_backend = SCRATCH_ZRAM;
+		scratch_size = need;
+
+		if (scratch_mount_zram() == 0)
+			return 0;
+
+		// Fall back to disk
+		anschroot_scratch_release();
+	}
+
+	scratch_backend = SCRATCH_DISK;
+	scratch_size = (need > SCRATCH_DISK_MIN) ? need : SCRATCH_DISK_MIN;
+
+	return scratch_mount_disk(scratch_dir);
+}
@@ -0,0 +1,254 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* The session registry.
+ *
+ * Every running session has a file in SESSION_DIR, named after its ID (the PID of the
+ * anschroot parent process), holding "key=value" lines. The file is kept locked for as long
+ * as the session runs, so entries left behind by sessions that died without cleaning up
+ * can be told apart from live ones (and removed).
+ */
+#define SESSION_DIR             "/run/anschroot/sessions"
+#define SESSION_DATA_MAX        4096
+
+static int      session_fd = -1;
+static char     session_id[32];
+static char     session_data[SESSION_DATA_MAX];
+static size_t   session_data_len = 0;
+
+static int session_write(void)
+{
+	if (pwrite(session_fd, session_data, session_data_len, 0) != (ssize_t) session_data_len)
+		return -1;
+
+	return ftruncate(session_fd, (off_t) session_data_len);
+}
+
+/* Set (or add) a key in our registry entry */
+int anschroot_session_set(const char* const key, const char* const value)
+{
+	if (session_fd == -1)
+		return -1;
+
+	const size_t key_len = strlen(key);
+
+	// Remove the existing line for this key (if any)
+	for (size_t i = 0; i < session_data_len; )
+	{
+		const char* const eol = memchr(session_data + i, '\n', session_data_len - i);
+		const size_t line_len = (size_t) (eol - (session_data + i)) + 1;
+
+		if (line_len > key_len && ! memcmp(session_data + i, key, key_len) && session_data[i + key_len] == '=')
+		{
+			(void) memmove(session_data + i, session_data + i + line_len, session_data_len - i - line_len);
+			session_data_len -= line_len;
+			continue;
+		}
+
+		i += line_len;
+	}
+
+	const int ret = snprintf(session_data + session_data_len, sizeof session_data - session_data_len,
+	                         "%s=%s\n", key, value);
+
+	if (ret < 0 || (size_t) ret >= sizeof session_data - session_data_len)
+	{
+		session_data[session_data_len] = '\0';
+		errno = ENOSPC;
+		return -1;
+	}
+
+	session_data_len += (size_t) ret;
+	return session_write();
+}
+
+int anschroot_session_register(const char* const root)
+{
+	if ((mkdir("/run/anschroot", 0755) != 0 && errno != EEXIST) || (mkdir(SESSION_DIR, 0755) != 0 && errno != EEXIST))
+		return -1;
+
+	(void) snprintf(session_id, sizeof session_id, "%ld", (long) getpid());
+
+	char path[PATH_MAX];
+	char tmppath[PATH_MAX];
+	(void) snprintf(path, sizeof path, "%s/%s", SESSION_DIR, session_id);
+	(void) snprintf(tmppath, sizeof tmppath, "%s/.%s", SESSION_DIR, session_id);
+
+	// Lock it before it becomes visible, or a concurrent anschroot_session_count() would reap it
+	if ((session_fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+		return -1;
+
+	if (flock(session_fd, LOCK_EX) != 0 || anschroot_session_set("root", root) != 0 || rename(tmppath, path) != 0)
+	{
+		const int errsv = errno;
+		(void) unlink(tmppath);
+		(void) close(session_fd);
+		session_fd = -1;
+		errno = errsv;
+		return -1;
+	}
+
+	return 0;
+}
+
+void anschroot_session_unregister(void)
+{
+	if (session_fd == -1)
+		return;
+
+	char path[PATH_MAX];
+	(void) snprintf(path, sizeof path, "%s/%s", SESSION_DIR, session_id);
+
+	(void) unlink(path);
+	(void) close(session_fd);
+	session_fd = -1;
+}
+
+/* Look up a key in some session's registry entry */
+int anschroot_session_get(const char* const id, const char* const key, char* const value, const size_t value_len)
+{
+	char path[PATH_MAX];
+	(void) snprintf(path, sizeof path, "%s/%s", SESSION_DIR, id);
+
+	int fd = -1;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	char data[SESSION_DATA_MAX];
+	const ssize_t data_len = read(fd, data, sizeof data - 1);
+	(void) close(fd);
+	if (data_len < 0)
+		return -1;
+
+	data[data_len] = '\0';
+
+	const size_t key_len = strlen(key);
+	char* saveptr = NULL;
+	for (char* line = strtok_r(data, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+	{
+		if (! strncmp(line, key, key_len) && line[key_len] == '=')
+		{
+			(void) snprintf(value, value_len, "%s", line + key_len + 1);
+			return 0;
+		}
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+// A session's entry is locked for as long as its anschroot is running
+static int session_locked(const int fd)
+{
+	return (flock(fd, LOCK_SH | LOCK_NB) != 0);
+}
+
+/* Whether the session id is still running (rather than a stale entry left by one that was
+ * killed)
+ */
+int anschroot_session_live(const char* const id)
+{
+	char path[PATH_MAX];
+	(void) snprintf(path, sizeof path, "%s/%s", SESSION_DIR, id);
+
+	int fd = -1;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return 0;
+
+	const int live = session_locked(fd);
+	(void) close(fd);
+
+	return live;
+}
+
+const char* anschroot_session_id(void)
+{
+	return session_id;
+}
+
+/* Call fn for every live session other than our own */
+void anschroot_session_foreach(void (*const fn)(const char* const id, void* const arg), void* const arg)
+{
+	DIR* dh = NULL;
+	if (! (dh = opendir(SESSION_DIR)))
+		return;
+
+	struct dirent* de = NULL;
+	while ((de = readdir(dh)))
+	{
+		if (de->d_name[0] == '.' || ! strcmp(de->d_name, session_id))
+			continue;
+
+		int fd = -1;
+		if ((fd = openat(dirfd(dh), de->d_name, O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+
+		const int live = session_locked(fd);
+		(void) close(fd);
+
+		if (live)
+			fn(de->d_name, arg);
+	}
+	(void) closedir(dh);
+}
+
+/* Count the live sessions (including our own), removing any stale entries along the way */
+unsigned int anschroot_session_count(void)
+{
+	DIR* dh = NULL;
+	if (! (dh = opendir(SESSION_DIR)))
+		return 1;
+
+	unsigned int count = 0;
+	struct dirent* de = NULL;
+	while ((de = readdir(dh)))
+	{
+		if (de->d_name[0] == '.')
+			continue;
+
+		int fd = -1;
+		if ((fd = openat(dirfd(dh), de->d_name, O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+
+		// If we can lock it, its session is gone
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+			(void) unlinkat(dirfd(dh), de->d_name, 0);
+		else
+			count++;
+
+		(void) close(fd);
+	}
+	(void) closedir(dh);
+
+	return count ? count : 1;
+}
@@ -0,0 +1,212 @@
+/*
+ * anschroot - chroot on steroids
+ *
+ * Copyright (C) 2015   Aaron M D Jones   <aaronmdjones@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE     1
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86              1
+#endif
+
+/* SHA-256.
+ *
+ * The block function is chosen at runtime: on x86 CPUs with the SHA extensions (Intel since
+ * Goldmont and Ice Lake, AMD since Zen), the SHA-NI instructions are used, which are several
+ * times faster than the portable C; everywhere else, the portable C is.
+ */
+#define SHA256_BLOCK_LEN        64
+#define SHA256_DIGEST_LEN       32
+
+static const uint32_t sha256_k[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static const uint32_t sha256_h0[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+#define SHA256_ROR(x, n)        (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_portable(uint32_t* const state, const uint8_t* data, size_t blocks)
+{
+	for (; blocks; blocks--, data += SHA256_BLOCK_LEN)
+	{
+		uint32_t w[64];
+
+		for (size_t i = 0; i < 16; i++)
+			w[i] = ((uint32_t) data[i * 4] << 24) | ((uint32_t) data[i * 4 + 1] << 16) |
+			       ((uint32_t) data[i * 4 + 2] << 8) | (uint32_t) data[i * 4 + 3];
+
+		for (size_t i = 16; i < 64; i++)
+		{
+			const uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			const uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (size_t i = 0; i < 64; i++)
+		{
+			const uint32_t t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) +
+			                    ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			const uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) +
+			                    ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef SHA256_X86
+
+/* The state is kept in the two registers the SHA-NI instructions expect (ABEF and CDGH), and
+ * the message schedule in four, each holding four words.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t* const state, const uint8_t* data, size_t blocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0C0D0E0F08090A0BLL, 0x0405060700010203LL);
+
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xB1);    // CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1B); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                       // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                            // CDGH
+
+	for (; blocks; blocks--, data += SHA256_BLOCK_LEN)
+	{
+		const __m128i abef = state0;
+		const __m128i cdgh = state1;
+		__m128i w[4];
+
+		for (size_t i = 0; i < 4; i++)
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + i * 16)), bswap);
+
+		for (size_t i = 0; i < 16; i++)
+		{
+			__m128i msg = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i*) &sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+			// The words for 4 rounds from now replace the ones just used
+			if (i < 12)
+			{
+				tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]),
+				                    _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+				w[i % 4] = _mm_sha256msg2_epu32(tmp, w[(i + 3) % 4]);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);                                                  // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);                                               // DCHG
+	_mm_storeu_si128((__m128i*) &state[0], _mm_blend_epi16(tmp, state1, 0xF0));             // DCBA
+	_mm_storeu_si128((__m128i*) &state[4], _mm_alignr_epi8(state1, tmp, 8));                // HGFE
+}
+
+static int sha256_have_shani(void)
+{
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+	if (! __get_cpuid(1, &eax, &ebx, &ecx, &edx) || ! (ecx & bit_SSE4_1))
+		return 0;
+
+	if (! __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ebx & (1U << 29)) ? 1 : 0;
+}
+
+#endif /* SHA256_X86 */
+
+static void (*sha256_blocks)(uint32_t* const state, const uint8_t* data, size_t blocks) = NULL;
+
+static void sha256_init(void)
+{
+	sha256_blocks = sha256_blocks_portable;
+
+#ifdef SHA256_X86
+	if (sha256_have_shani())
+		sha256_blocks = sha256_blocks_shani;
+#endif
+}
+
+// The SHA-256 digest of len bytes at data
+void anschroot_sha256(const void* const data, const size_t len, uint8_t* const digest)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	(void) pthread_once(&once, sha256_init);
+
+	uint32_t state[8];
+	(void) memcpy(state, sha256_h0, sizeof state);
+
+	const size_t blocks = len / SHA256_BLOCK_LEN;
+	sha256_blocks(state, data, blocks);
+
+	// The final block(s): what's left, a 1 bit, padding, and the length in bits
+	uint8_t tail[SHA256_BLOCK_LEN * 2];
+	const size_t rest = len % SHA256_BLOCK_LEN;
+	const size_t tail_len = (rest < SHA256_BLOCK_LEN - 8) ? SHA256_BLOCK_LEN : (SHA256_BLOCK_LEN * 2);
+
+	(void) memset(tail, 0x00, sizeof tail);
+	(void) memcpy(tail, (const uint8_t*) data + blocks * SHA256_BLOCK_LEN, rest);
+	tail[rest] = 0x80;
+
+	const uint64_t bits = (uint64_t) len * 8;
+	for (size_t i = 0; i < 8; i++)
+		tail[tail_len - 1 - i] = (uint8_t) (bits >> (i * 8));
+
+	sha256_blocks(state, tail, tail_len / SHA256_BLOCK_LEN);
+
+	for (size_t i = 0; i < 8; i++)
+	{
+		digest[i * 4] = (uint8_t) (state[i] >> 24);
+		digest[i * 4 + 1] = (uint8_t) (state[i] >> 16);
+		digest[i * 4 + 2] = (uint8_t) (state[i] >> 8);
+		digest[i * 4 + 3] = (uint8_t) state[i];
+	}
+}
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# anschroot - chroot on steroids
+#
+# Measure how long session setup takes as more sessions are started at once.
+#
+# Usage: bench-concurrency.sh <directory|image> <executable> [N ...]
+#
+# For each N (by default 1, 10 and 40), starts N sessions at the same time, waits for all
+# of them, and prints the mean time each spent in the unshare, umount and mount setup phases
+# (and in the whole of its setup), from anschroot's metrics. The executable should exit
+# straight away (e.g. /bin/true). Set ANSCHROOT to the anschroot to run, and pass e.g.
+# "-P slave" in ANSCHROOT_OPTS to compare propagation types.
+
+set -eu
+
+ANSCHROOT="${ANSCHROOT:-anschroot}"
+ANSCHROOT_OPTS="${ANSCHROOT_OPTS:-}"
+PHASES="unshare umount mount total"
+
+if [ $# -lt 2 ]
+then
+	echo "Usage: $0 <directory|image> <executable> [N ...]" >&2
+	exit 1
+fi
+
+root="$1"
+executable="$2"
+shift 2
+[ $# -gt 0 ] || set -- 1 10 40
+
+dir="$(mktemp -d)"
+trap 'rm -rf "${dir}"' EXIT
+
+run()
+{
+	# shellcheck disable=SC2086
+	"${ANSCHROOT}" ${ANSCHROOT_OPTS} --metrics-dir="${dir}" "${root}" "${executable}" >/dev/null 2>&1 || true
+}
+
+# "<phase> <sum> <count>" for each phase, from the metrics file
+snapshot()
+{
+	awk -v phases="${PHASES}" '
+		BEGIN { n = split(phases, p, " "); for (i = 1; i <= n; i++) want[p[i]] = 1 }
+		/^anschroot_setup_phase_seconds_(sum|count)\{/ {
+			split($1, f, "\"")
+			if (! (f[2] in want)) next
+			if ($1 ~ /_sum\{/) sum[f[2]] = $2; else count[f[2]] = $2
+		}
+		END { for (i = 1; i <= n; i++) print p[i], sum[p[i]] + 0, count[p[i]] + 0 }
+	' "${dir}/anschroot.prom" > "${dir}/$1"
+}
+
+# Once beforehand, to have a starting point (and warm the caches up)
+run
+snapshot before
+
+printf "%8s" "sessions"
+for phase in ${PHASES}
+do
+	printf " %12s" "${phase} (ms)"
+done
+printf "\n"
+
+for n in "$@"
+do
+	i=0
+	while [ "${i}" -lt "${n}" ]
+	do
+		run &
+		i=$((i + 1))
+	done
+	wait
+
+	snapshot after
+
+	printf "%8s" "${n}"
+	awk '
+		NR == FNR { sum[$1] = $2; count[$1] = $3; next }
+		{
+			sessions = $3 - count[$1]
+			printf " %12.3f", sessions ? (($2 - sum[$1]) * 1000 / sessions) : 0
+		}
+	' "${dir}/before" "${dir}/after"
+	printf "\n"
+
+	mv "${dir}/after" "${dir}/before"
+done